@@ -1,11 +1,35 @@
 #include "CumulativeDistributionFunction.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <list>
+#include <mutex>
 #include <stdexcept>
 
 
+namespace
+{
+	/// Distributions built last, most recent first. Shared by all instances:
+	/// the galaxy rebuilds the distribution for every new population and
+	/// after each edit of a radius, and slider drags revisit the same values.
+	struct CdfCache
+	{
+		static constexpr std::size_t Capacity = 8;
+
+		std::mutex mutex;
+		std::list<CumulativeDistributionFunction> entries;
+	};
+
+	CdfCache& GetCdfCache()
+	{
+		static CdfCache cache;
+		return cache;
+	}
+}
+
+
 CumulativeDistributionFunction::CumulativeDistributionFunction()
 	: _vM1()
 	, _vY1()
@@ -13,6 +37,7 @@ CumulativeDistributionFunction::CumulativeDistributionFunction()
 	, _vM2()
 	, _vY2()
 	, _vX2()
+	, _vInverse()
 	, _fMin()
 	, _fMax()
 	, _nSteps()
@@ -25,6 +50,28 @@ CumulativeDistributionFunction::CumulativeDistributionFunction()
 
 void CumulativeDistributionFunction::SetupRealistic(double I0, double k, double a, double RBulge, double min, double max, int nSteps)
 {
+	auto isSame = [&](const CumulativeDistributionFunction& cdf)
+	{
+		return !cdf._vInverse.empty()
+			&& cdf._I0 == I0 && cdf._k == k && cdf._a == a && cdf._RBulge == RBulge
+			&& cdf._fMin == min && cdf._fMax == max && cdf._nSteps == nSteps;
+	};
+
+	if (isSame(*this))
+		return;
+
+	auto& cache = GetCdfCache();
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		auto it = std::find_if(cache.entries.begin(), cache.entries.end(), isSame);
+		if (it != cache.entries.end())
+		{
+			cache.entries.splice(cache.entries.begin(), cache.entries, it);
+			*this = cache.entries.front();
+			return;
+		}
+	}
+
 	_fMin = min;
 	_fMax = max;
 	_nSteps = nSteps;
@@ -35,6 +82,11 @@ void CumulativeDistributionFunction::SetupRealistic(double I0, double k, double
 	_RBulge = RBulge;
 
 	BuildCDF(_nSteps);
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.entries.push_front(*this);
+	if (cache.entries.size() > CdfCache::Capacity)
+		cache.entries.pop_back();
 }
 
 void CumulativeDistributionFunction::BuildCDF(int nSteps)
@@ -104,10 +156,18 @@ void CumulativeDistributionFunction::BuildCDF(int nSteps)
 	if (_vM2.size() != _vX2.size() || _vM2.size() != _vY2.size())
 		throw std::runtime_error("CumulativeDistributionFunction::BuildCDF: array size mismatch (1)!");
 
+	// Table step as in ValFromProb
+	h = 1.0 / (_vY2.size() - 1);
+	_vInverse.resize(2 * _vY2.size());
+	for (std::size_t i = 0; i < _vY2.size(); ++i)
+	{
+		_vInverse[2 * i] = (float)_vY2[i];
+		_vInverse[2 * i + 1] = (float)(_vM2[i] * h);
+	}
 }
 
 
-double CumulativeDistributionFunction::ProbFromVal(double fVal)
+double CumulativeDistributionFunction::ProbFromVal(double fVal) const
 {
 	if (fVal<_fMin || fVal>_fMax)
 		throw std::runtime_error("out of range");
@@ -123,7 +183,7 @@ double CumulativeDistributionFunction::ProbFromVal(double fVal)
 }
 
 
-double CumulativeDistributionFunction::ValFromProb(double fVal)
+double CumulativeDistributionFunction::ValFromProb(double fVal) const
 {
 	if (fVal < 0 || fVal>1)
 		throw std::runtime_error("out of range");
@@ -138,6 +198,22 @@ double CumulativeDistributionFunction::ValFromProb(double fVal)
 }
 
 
+void CumulativeDistributionFunction::ValFromProb(const float* prob, float* val, std::size_t count) const
+{
+	// In units of table steps: the integer part is the table index, the
+	// fractional part the remainder
+	const float* table = _vInverse.data();
+	const int last = (int)(_vInverse.size() / 2) - 1;
+	const float scale = (float)last;
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		const float x = std::clamp(prob[i], 0.0f, 1.0f) * scale;
+		const int idx = std::min((int)x, last);
+		val[i] = table[2 * idx] + table[2 * idx + 1] * (x - (float)idx);
+	}
+}
+
+
 double CumulativeDistributionFunction::IntensityBulge(double R, double I0, double k)
 {
 	return I0 * exp(-k * pow(R, 0.25));
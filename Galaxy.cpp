@@ -1,14 +1,29 @@
 #include "Galaxy.hpp"
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <stdexcept>
 #include <cmath>
 #include <iostream>
-#include <algorithm>
+#include <limits>
+#include <random>
 
 #include "Helper.hpp"
 #include "Types.hpp"
-#include "CumulativeDistributionFunction.hpp"
+#include "CounterRandom.hpp"
+#include "QuasiRandom.hpp"
+#include "RadialProfile.hpp"
+
+
+namespace
+{
+	/// Number of filaments generated by one task (each filament has up to 100
+	/// particles).
+	const int FilamentsPerChunk = 64;
+
+	/// Number of particles Galaxy::Derive keeps on the stack at once.
+	const std::size_t DeriveBlockSize = 256;
+}
 
 
 Galaxy::Galaxy(
@@ -27,7 +42,7 @@ Galaxy::Galaxy(
 	, _numStars(numStars)
 	, _numDust(numStars)
 	, _numH2(400)
-	, _seed((unsigned int)std::rand())
+	, _seed(std::random_device()())
 	, _pertN(0)
 	, _pertAmp(0)
 	, _hasDarkMatter(true)
@@ -35,8 +50,24 @@ Galaxy::Galaxy(
 	, _hasBar(false)
 	, _barRadius(3000.0f)
 	, _barEx(0.55f)
+	, _quasiRandom(false)
 	, _stars()
+	, _layout()
 	, _dustRenderSize(70)
+	, _profile()
+	, _numThreads(0)
+	, _workers()
+	, _buildStats()
+	, _builtStars(0)
+	, _builtDust(0)
+	, _builtH2(0)
+	, _rebuildPending(true)
+	, _pending(dfNone)
+	, _deferred(false)
+	, _cancel(nullptr)
+	, _filamentOffsets(1, 0)
+	, _changes()
+	, _ackedSize(0)
 {}
 
 Galaxy::~Galaxy()
@@ -62,9 +93,185 @@ void Galaxy::Reset(GalaxyParam param)
 	_hasBar = param.hasBar;
 	_barRadius = std::min(param.barRadius, _radCore);
 	_barEx = param.barEx;
-	_seed = (unsigned int)std::rand();
+	_quasiRandom = param.quasiRandom;
+	_seed = std::random_device()();
+
+	_rebuildPending = true;
+	Invalidate(dfNone);
+}
+
+Galaxy::Snapshot Galaxy::GetSnapshot() const
+{
+	Snapshot snapshot;
+	GalaxyParam& param = snapshot.param;
+	param.rad = _radGalaxy;
+	param.radCore = _radCore;
+	param.deltaAng = _angleOffset;
+	param.ex1 = _elEx1;
+	param.ex2 = _elEx2;
+	param.numStars = _numStars;
+	param.hasDarkMatter = _hasDarkMatter;
+	param.pertN = _pertN;
+	param.pertAmp = _pertAmp;
+	param.dustRenderSize = _dustRenderSize;
+	param.baseTemp = _baseTemp;
+	param.numDust = _numDust;
+	param.numH2 = _numH2;
+	param.hasBar = _hasBar;
+	param.barRadius = _barRadius;
+	param.barEx = _barEx;
+	param.quasiRandom = _quasiRandom;
+	snapshot.radFarField = _radFarField;
+	snapshot.seed = _seed;
+	return snapshot;
+}
 
-	InitStarsAndDust();
+void Galaxy::Apply(const Snapshot& snapshot)
+{
+	const GalaxyParam& param = snapshot.param;
+
+	uint32_t fields = dfNone;
+	if (param.rad != _radGalaxy || param.radCore != _radCore || snapshot.radFarField != _radFarField)
+		fields |= dfRadius;
+
+	if (param.ex1 != _elEx1 || param.ex2 != _elEx2 || param.barEx != _barEx)
+		fields |= dfShape;
+
+	if (param.hasBar != _hasBar || param.barRadius != _barRadius)
+		fields |= dfShape | dfTilt;
+
+	if (param.deltaAng != _angleOffset)
+		fields |= dfTilt;
+
+	if (param.hasDarkMatter != _hasDarkMatter)
+		fields |= dfVelocity;
+
+	if (param.baseTemp != _baseTemp)
+		fields |= dfTemp;
+
+	if (snapshot.seed != _seed || param.quasiRandom != _quasiRandom)
+		_rebuildPending = true;
+
+	_radGalaxy = param.rad;
+	_radCore = param.radCore;
+	_radFarField = snapshot.radFarField;
+	_angleOffset = param.deltaAng;
+	_elEx1 = param.ex1;
+	_elEx2 = param.ex2;
+	_numStars = param.numStars;
+	_numDust = param.numDust;
+	_numH2 = param.numH2;
+	_hasDarkMatter = param.hasDarkMatter;
+	_pertN = param.pertN;
+	_pertAmp = param.pertAmp;
+	_dustRenderSize = param.dustRenderSize;
+	_baseTemp = param.baseTemp;
+	_hasBar = param.hasBar;
+	_barRadius = param.barRadius;
+	_barEx = param.barEx;
+	_quasiRandom = param.quasiRandom;
+	_seed = snapshot.seed;
+
+	Invalidate(fields);
+}
+
+void Galaxy::SetDeferredUpdate(bool deferred)
+{
+	_deferred = deferred;
+}
+
+void Galaxy::SetCancelFlag(const std::atomic<bool>* cancel)
+{
+	_cancel = cancel;
+}
+
+bool Galaxy::IsCancelled() const noexcept
+{
+	return _cancel != nullptr && _cancel->load(std::memory_order_relaxed);
+}
+
+WorkerPool& Galaxy::Workers() const
+{
+	if (!_workers)
+		_workers.reset(new WorkerPool(_numThreads));
+
+	return *_workers;
+}
+
+/** \brief Marks the given fields of the population out of date. */
+void Galaxy::Invalidate(uint32_t fields)
+{
+	_pending |= fields;
+	if (!_deferred)
+		Update();
+}
+
+bool Galaxy::IsUpToDate() const noexcept
+{
+	return !_rebuildPending
+		&& _pending == dfNone
+		&& _builtStars == _numStars
+		&& _builtDust == _numDust
+		&& _builtH2 == _numH2;
+}
+
+bool Galaxy::Update()
+{
+	if (IsUpToDate())
+		return true;
+
+	const auto t = Clock::now();
+	_buildStats = BuildStats();
+	_buildStats.numThreads = Workers().GetNumThreads();
+
+	// Set up before any worker reads it
+	GetRadialProfile();
+
+	if (_rebuildPending)
+	{
+		if (!InitStarsAndDust())
+			return false;
+
+		_rebuildPending = false;
+		_pending = dfNone;
+	}
+	else if (_pending != dfNone)
+	{
+		// Existing particles first: new ones are generated from the current
+		// parameters anyway.
+		if (!UpdateDerived(_pending))
+			return false;
+
+		_pending = dfNone;
+	}
+
+	// Count changes only take time proportional to the change and would
+	// leave the population inconsistent when interrupted; they run to the
+	// end.
+	const std::atomic<bool>* cancel = _cancel;
+	_cancel = nullptr;
+	ResizeStars();
+	ResizeDust();
+	ResizeH2();
+	_cancel = cancel;
+
+	_layout.numStars = _builtStars;
+	_layout.numDust = _builtDust;
+	_layout.numFilaments = _filamentOffsets.back();
+	_layout.numH2 = 2 * (std::size_t)_builtH2;
+
+	_buildStats.msTotal = MsSince(t);
+	return true;
+}
+
+void Galaxy::SetPopulation(std::vector<Star>&& stars, const std::vector<Change>& changes, const Layout& layout, const BuildStats& stats)
+{
+	for (const auto& change : changes)
+		AddChange(change.first, change.removed, change.inserted, change.fields);
+
+	_stars = std::move(stars);
+	_layout = layout;
+	_buildStats = stats;
 }
 
 bool Galaxy::HasDarkMatter() const noexcept
@@ -75,24 +282,81 @@ bool Galaxy::HasDarkMatter() const noexcept
 void Galaxy::ToggleDarkMatter()
 {
 	_hasDarkMatter ^= true;
-	InitStarsAndDust();
+	Invalidate(dfVelocity);
 }
 
-void Galaxy::InitStarsAndDust()
+/** \brief Generates a new population. Returns false if cancelled. */
+bool Galaxy::InitStarsAndDust()
 {
-	// Reseed so rebuilds with tweaked parameters morph the same star
-	// population instead of rerolling it (needed for live slider updates).
-	std::srand(_seed);
-
+	_builtStars = _numStars;
+	_builtDust = _numDust;
+	_builtH2 = _numH2;
+
+	// Every random number is a function of (_seed, particle class, particle
+	// index, draw index). Rebuilds with tweaked parameters therefore morph the
+	// same star population instead of rerolling it (needed for live slider
+	// updates) and the result neither depends on the number of worker threads
+	// nor on the C library.
 	_stars = std::vector<Star>();
-	_stars.reserve(_numStars + _numDust + _numDust / 2 + 2 * _numH2);
+	_stars.reserve(_numStars + _numDust + (_numDust / 100) * 100 + 2 * _numH2);
+	_stars.resize(_numStars + _numDust);
+	_radius.Clear();
+	_radius.Resize(_stars.size());
+
+	SetupRadialDistribution();
 
 	//
 	// 1.) Initialize the stars
 	//
 
-	CumulativeDistributionFunction cdf;
-	cdf.SetupRealistic(
+	auto t = Clock::now();
+	GenerateStars(0, _numStars, 0);
+	_buildStats.msStars = MsSince(t);
+	if (IsCancelled())
+		return false;
+
+	//
+	// 2.) Initialise Dust:
+	//
+
+	t = Clock::now();
+	GenerateDust(0, _numDust, GetDustOffset());
+	_buildStats.msDust = MsSince(t);
+	if (IsCancelled())
+		return false;
+
+	//
+	// 3.) Initialize additional dust filaments
+	//
+
+	t = Clock::now();
+	_filamentOffsets.assign(1, 0);
+	GenerateFilaments(0, _numDust / 100, _stars, _radius);
+	_buildStats.msFilaments = MsSince(t);
+	if (IsCancelled())
+		return false;
+
+	//
+	// 4.) Initialise H2 regions
+	// 
+
+	t = Clock::now();
+	_stars.resize(_stars.size() + 2 * (std::size_t)_numH2);
+	_radius.Resize(_stars.size());
+	GenerateH2(0, _numH2, GetH2Offset());
+	_buildStats.msH2 = MsSince(t);
+	if (IsCancelled())
+		return false;
+
+	// Everything changed
+	_changes.clear();
+	AddChange(0, _ackedSize, _stars.size());
+	return true;
+}
+
+void Galaxy::SetupRadialDistribution()
+{
+	_cdf.SetupRealistic(
 		1.0,				// maximum intensity
 		0.02,				// k (bulge)
 		_radGalaxy / 3.0f,	// disc scale length
@@ -100,125 +364,500 @@ void Galaxy::InitStarsAndDust()
 		0,					// start  of the intnesity curve
 		_radFarField,		// end of the intensity curve
 		1000);				// number of supporting points
+}
+
+/** \brief Re-derives the given fields of all particles after a parameter
+	change. The random draws stay as they are. Returns false if cancelled.
+*/
+bool Galaxy::UpdateDerived(uint32_t fields)
+{
+	const auto t = Clock::now();
+	if (fields & dfRadius)
+		SetupRadialDistribution();
+
+	// The temperature is only derived for dust and filaments
+	std::size_t first = 0, last = _stars.size();
+	if ((fields & ~dfTemp) == 0)
+	{
+		first = GetDustOffset();
+		last = GetH2Offset();
+	}
+
+	const std::size_t num = last - first;
+	Workers().ParallelFor((int)((num + ChunkSize - 1) / ChunkSize), [&](int chunk)
+	{
+		if (IsCancelled())
+			return;
+
+		const std::size_t chunkFirst = first + (std::size_t)chunk * ChunkSize;
+		Derive(_stars.data(), _radius, chunkFirst, std::min(last, chunkFirst + ChunkSize), fields);
+	});
 
-	for (int i = 0; i < _numStars; ++i)
+	_buildStats.msDerive += MsSince(t);
+	if (IsCancelled())
+		return false;
+
+	// The particles changed in place. As in Derive, a new radius changes
+	// everything and the velocity of dust depends on its minor axis.
+	uint32_t changed = (fields & dfRadius) ? (uint32_t)dfAll : fields;
+	if (changed & dfShape)
+		changed |= dfVelocity;
+
+	if (num > 0)
+		AddChange(first, num, num, changed);
+
+	return true;
+}
+
+/** \brief Derives the parameter dependent fields of particles first ... last - 1
+	from their radius draws.
+
+	The particles are processed in blocks held as structure of arrays on the
+	stack. The profiles of the galaxy come from tables (see RadialProfile)
+	and the loops are free of branches, so the compiler can vectorize them.
+	\param stars The particles; stars[i] belongs to draw i of draws
+	\param fields The DerivedField bits to update
+*/
+void Galaxy::Derive(Star* stars, const RadiusDraws& draws, std::size_t first, std::size_t last, uint32_t fields) const
+{
+	// Everything depends on the radius; the velocity of dust particles
+	// depends on their minor axis too.
+	if (fields & dfRadius)
+		fields = dfAll;
+
+	const bool starVelocity = (fields & dfVelocity) != 0;
+	if (fields & dfShape)
+		fields |= dfVelocity;
+
+	// Set up by Update()
+	const RadialProfile& profile = _profile;
+
+	float rad[DeriveBlockSize];
+	float b[DeriveBlockSize];
+	float tmp[DeriveBlockSize];
+	float vel[DeriveBlockSize];
+	for (std::size_t block = first; block < last; block += DeriveBlockSize)
 	{
-		float rad = (float)cdf.ValFromProb(Helper::rnum());
-		auto star = Star();
-		star.a = rad;
-		star.b = rad * GetExcentricity(rad);
-		star.tiltAngle = GetAngularOffset(rad);
-		star.theta0 = 360.0f * Helper::rnum();
-		star.velTheta = GetOrbitalVelocity(rad);
-		star.temp = 6000 + (4000 * Helper::rnum() - 2000);
-		star.mag = 0.1f + 0.4f * Helper::rnum();
-		star.type = 0;
-
-		// Make a small portion of the stars brighter
-		if (i < _numStars / 60)
+		const std::size_t num = std::min(DeriveBlockSize, last - block);
+		Star* s = stars + block;
+		const float* sample = draws.sample.data() + block;
+		const float* offset = draws.offset.data() + block;
+		const uint8_t* mode = draws.mode.data() + block;
+
+		if (fields & dfRadius)
+		{
+			// Both radius modes for all particles, then pick: cheaper than
+			// branching per particle
+			_cdf.ValFromProb(sample, tmp, num);
+			for (std::size_t i = 0; i < num; ++i)
+				rad[i] = (mode[i] == rmCdf) ? tmp[i] : _radGalaxy * sample[i] + offset[i];
+
+			for (std::size_t i = 0; i < num; ++i)
+				s[i].a = rad[i];
+		}
+		else
+		{
+			for (std::size_t i = 0; i < num; ++i)
+				rad[i] = s[i].a;
+		}
+
+		if (fields & dfShape)
+		{
+			profile.Eval(RadialProfile::chExcentricity, rad, tmp, num);
+			for (std::size_t i = 0; i < num; ++i)
+			{
+				b[i] = rad[i] * tmp[i];
+				s[i].b = b[i];
+			}
+		}
+		else
+		{
+			for (std::size_t i = 0; i < num; ++i)
+				b[i] = s[i].b;
+		}
+
+		if (fields & dfTilt)
 		{
-			star.mag = std::min(star.mag + 0.1f + Helper::rnum() * 0.4f, 1.0f);
+			profile.Eval(RadialProfile::chTilt, rad, tmp, num);
+			for (std::size_t i = 0; i < num; ++i)
+				s[i].tiltAngle = tmp[i];
 		}
 
-		_stars.push_back(star);
+		if (fields & dfVelocity)
+		{
+			// Stars move with the velocity at their radius, dust clouds with
+			// the one at their mean radius.
+			for (std::size_t i = 0; i < num; ++i)
+				tmp[i] = (s[i].type == 0) ? rad[i] : (rad[i] + b[i]) / 2.0f;
+
+			profile.EvalAngularVelocity(tmp, vel, num);
+			for (std::size_t i = 0; i < num; ++i)
+			{
+				if (starVelocity || s[i].type != 0)
+					s[i].velTheta = vel[i];
+			}
+		}
+
+		if (fields & dfTemp)
+		{
+			// I want the outer parts to appear blue, the inner parts yellow. I'm imposing
+			// the following temperature distribution (no science here it just looks right)
+			for (std::size_t i = 0; i < num; ++i)
+			{
+				const int type = s[i].type;
+				const float temp = _baseTemp + rad[i] / 4.5f - ((type == 2) ? 1000.0f : 0.0f);
+				s[i].temp = (type == 1 || type == 2) ? temp : s[i].temp;
+			}
+		}
 	}
+}
 
-	//
-	// 2.) Initialise Dust:
-	//
+void Galaxy::RadiusDraws::Set(std::size_t idx, const RadiusDraw& draw)
+{
+	sample[idx] = draw.sample;
+	offset[idx] = draw.offset;
+	mode[idx] = draw.mode;
+}
+
+void Galaxy::RadiusDraws::Push(const RadiusDraw& draw)
+{
+	sample.push_back(draw.sample);
+	offset.push_back(draw.offset);
+	mode.push_back(draw.mode);
+}
+
+void Galaxy::RadiusDraws::Resize(std::size_t size)
+{
+	sample.resize(size);
+	offset.resize(size);
+	mode.resize(size);
+}
 
-	float x, y, rad;
-	for (int i = 0; i < _numDust; ++i)
+void Galaxy::RadiusDraws::Insert(std::size_t pos, std::size_t num)
+{
+	sample.insert(sample.begin() + pos, num, 0.0f);
+	offset.insert(offset.begin() + pos, num, 0.0f);
+	mode.insert(mode.begin() + pos, num, (uint8_t)rmCdf);
+}
+
+void Galaxy::RadiusDraws::Insert(std::size_t pos, const RadiusDraws& draws)
+{
+	sample.insert(sample.begin() + pos, draws.sample.begin(), draws.sample.end());
+	offset.insert(offset.begin() + pos, draws.offset.begin(), draws.offset.end());
+	mode.insert(mode.begin() + pos, draws.mode.begin(), draws.mode.end());
+}
+
+void Galaxy::RadiusDraws::Erase(std::size_t first, std::size_t last)
+{
+	sample.erase(sample.begin() + first, sample.begin() + last);
+	offset.erase(offset.begin() + first, offset.begin() + last);
+	mode.erase(mode.begin() + first, mode.begin() + last);
+}
+
+void Galaxy::RadiusDraws::Clear()
+{
+	sample.clear();
+	offset.clear();
+	mode.clear();
+}
+
+double Galaxy::MsSince(Clock::time_point t)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+void Galaxy::AddChange(std::size_t first, std::size_t removed, std::size_t inserted, uint32_t fields)
+{
+	AddChange(_changes, first, removed, inserted, fields);
+}
+
+/** \brief Appends a change and moves the data ranges of the earlier ones.
+
+	Every change keeps its own fields: a range that grows over the particles
+	of a later change refreshes them with its fields too, the later change
+	adds its own.
+*/
+void Galaxy::AddChange(std::vector<Change>& changes, std::size_t first, std::size_t removed, std::size_t inserted, uint32_t fields)
+{
+	// Keep track of where the new particles of the earlier changes are now.
+	// Ranges touched by this change grow to cover it, which is conservative:
+	// the consumer uploads the final particle data of the range.
+	for (auto& change : changes)
 	{
-		if (i % 2 == 0)
+		auto& dataFirst = change.dataFirst;
+		auto& dataCount = change.dataCount;
+		if (first >= dataFirst + dataCount)
+			continue;
+
+		if (first + removed <= dataFirst)
 		{
-			rad = (float)cdf.ValFromProb(Helper::rnum());
+			dataFirst = dataFirst - removed + inserted;
 		}
 		else
 		{
-			x = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-			y = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-			rad = sqrt(x * x + y * y);
+			const std::size_t end = std::max(dataFirst + dataCount, first + removed) - removed + inserted;
+			dataFirst = std::min(dataFirst, first);
+			dataCount = std::max(end, first + inserted) - dataFirst;
 		}
-
-		auto dustParticle = Star();
-		dustParticle.a = rad;
-		dustParticle.b = rad * GetExcentricity(rad);
-		dustParticle.tiltAngle = GetAngularOffset(rad);
-		dustParticle.theta0 = 360.0f * Helper::rnum();
-		dustParticle.velTheta = GetOrbitalVelocity((dustParticle.a + dustParticle.b) / 2.0f);
-		dustParticle.type = 1;
-
-		// I want the outer parts to appear blue, the inner parts yellow. I'm imposing
-		// the following temperature distribution (no science here it just looks right)
-		dustParticle.temp = _baseTemp + rad / 4.5f;
-		dustParticle.mag = 0.02f + 0.15f * Helper::rnum();
-		_stars.push_back(dustParticle);
 	}
 
-	//
-	// 3.) Initialize additional dust filaments
-	//
+	changes.push_back({ first, removed, inserted, first, inserted, fields });
+}
+
+const std::vector<Galaxy::Change>& Galaxy::GetChanges() const noexcept
+{
+	return _changes;
+}
 
-	for (int i = 0; i < _numDust / 100; ++i)
+void Galaxy::ClearChanges()
+{
+	_changes.clear();
+	_ackedSize = _stars.size();
+}
+
+std::size_t Galaxy::GetDustOffset() const noexcept
+{
+	return (std::size_t)_builtStars;
+}
+
+std::size_t Galaxy::GetFilamentOffset() const noexcept
+{
+	return (std::size_t)_builtStars + _builtDust;
+}
+
+std::size_t Galaxy::GetH2Offset() const noexcept
+{
+	return GetFilamentOffset() + _filamentOffsets.back();
+}
+
+/** \brief Generates stars number first ... last - 1 at position pos of the
+	particle array.
+*/
+void Galaxy::GenerateStars(int first, int last, std::size_t pos)
+{
+	const int num = last - first;
+	Workers().ParallelFor((num + ChunkSize - 1) / ChunkSize, [&](int chunk)
 	{
-		rad = (float)cdf.ValFromProb(Helper::rnum());
-
-		x = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-		y = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-		rad = sqrt(x * x + y * y);
-
-		auto theta = 360.0f * Helper::rnum();
-		auto mag = 0.1f + 0.05f * Helper::rnum();
-		auto a = rad;
-		auto b = rad * GetExcentricity(rad);
-		auto num = (int)(100 * Helper::rnum());
-		auto temp = _baseTemp + rad / 4.5f - 2000;
-		for (int i = 0; i < num; ++i)
+		if (IsCancelled())
+			return;
+
+		const int chunkFirst = first + chunk * ChunkSize;
+		const int chunkNum = std::min(last - chunkFirst, ChunkSize);
+
+		// draws 0..3 of the whole chunk in one go: radius, angle, temperature
+		// and magnitude
+		std::vector<float> draws(4 * (std::size_t)chunkNum);
+		if (_quasiRandom)
+			QuasiRandom(_seed, rsStars).FillBlock(chunkFirst, chunkNum, draws.data());
+		else
+			CounterRandom(_seed, rsStars).FillBlock(chunkFirst, chunkNum, 0, draws.data());
+
+		const std::size_t chunkPos = pos + (chunkFirst - first);
+		for (int i = 0; i < chunkNum; ++i)
 		{
-			rad = rad + 200 - 400 * Helper::rnum();
-			auto dustParticle = Star();
-			dustParticle.a = rad;
-			dustParticle.b = rad * GetExcentricity(rad);
-			dustParticle.tiltAngle = GetAngularOffset(rad);
-			dustParticle.theta0 = theta + 10 - 20 * Helper::rnum();
-			dustParticle.velTheta = GetOrbitalVelocity((dustParticle.a + dustParticle.b) / 2.0f);
+			InitStar(chunkFirst + i, &draws[i], chunkNum, _stars[chunkPos + i]);
+			_radius.Set(chunkPos + i, { draws[i], 0, rmCdf });
+		}
 
-			// I want the outer parts to appear blue, the inner parts yellow. I'm imposing
-			// the following temperature distribution (no science here it just looks right)
-			dustParticle.temp = _baseTemp + rad / 4.5f - 1000;;
-			dustParticle.mag = mag + 0.025f * Helper::rnum();
-			dustParticle.type = 2;
-			_stars.push_back(dustParticle);
+		Derive(_stars.data(), _radius, chunkPos, chunkPos + chunkNum, dfAll);
+	});
+}
+
+/** \brief Generates dust particles number first ... last - 1 at position pos
+	of the particle array.
+*/
+void Galaxy::GenerateDust(int first, int last, std::size_t pos)
+{
+	const int num = last - first;
+	Workers().ParallelFor((num + ChunkSize - 1) / ChunkSize, [&](int chunk)
+	{
+		if (IsCancelled())
+			return;
+
+		const int chunkFirst = first + chunk * ChunkSize;
+		const int chunkLast = std::min(last, chunkFirst + ChunkSize);
+		for (int i = chunkFirst; i < chunkLast; ++i)
+			_radius.Set(pos + (i - first), InitDust(i, _stars[pos + (i - first)]));
+
+		Derive(_stars.data(), _radius, pos + (chunkFirst - first), pos + (chunkLast - first), dfAll);
+	});
+}
+
+/** \brief Appends the particles of filaments number first ... last - 1 to stars,
+	their radius draws to draws and their end offsets to _filamentOffsets.
+*/
+void Galaxy::GenerateFilaments(int first, int last, std::vector<Star>& stars, RadiusDraws& draws)
+{
+	// Filaments have a random length, so every task collects its particles
+	// separately; they are appended in order afterwards.
+	const int num = last - first;
+	std::vector<std::vector<Star>> chunks((num + FilamentsPerChunk - 1) / FilamentsPerChunk);
+	std::vector<RadiusDraws> chunkDraws(chunks.size());
+	std::vector<std::vector<std::size_t>> sizes(chunks.size());
+	Workers().ParallelFor((int)chunks.size(), [&](int chunk)
+	{
+		if (IsCancelled())
+			return;
+
+		const int chunkFirst = first + chunk * FilamentsPerChunk;
+		const int chunkLast = std::min(last, chunkFirst + FilamentsPerChunk);
+		for (int i = chunkFirst; i < chunkLast; ++i)
+		{
+			AddFilament(i, chunks[chunk], chunkDraws[chunk]);
+			sizes[chunk].push_back(chunks[chunk].size());
 		}
+
+		Derive(chunks[chunk].data(), chunkDraws[chunk], 0, chunks[chunk].size(), dfAll);
+	});
+
+	for (std::size_t chunk = 0; chunk < chunks.size(); ++chunk)
+	{
+		const std::size_t offset = _filamentOffsets.back();
+		for (auto size : sizes[chunk])
+			_filamentOffsets.push_back(offset + size);
+
+		stars.insert(stars.end(), chunks[chunk].begin(), chunks[chunk].end());
+		draws.Insert(draws.sample.size(), chunkDraws[chunk]);
 	}
-	
-	//
-	// 4.) Initialise H2 regions
-	// 
+}
+
+/** \brief Generates H2 regions number first ... last - 1 at position pos of
+	the particle array. Each region consists of two particles: the halo
+	(type 3) and the core (type 4).
+*/
+void Galaxy::GenerateH2(int first, int last, std::size_t pos)
+{
+	const int num = last - first;
+	Workers().ParallelFor((num + ChunkSize - 1) / ChunkSize, [&](int chunk)
+	{
+		if (IsCancelled())
+			return;
+
+		const int chunkFirst = first + chunk * ChunkSize;
+		const int chunkLast = std::min(last, chunkFirst + ChunkSize);
+		for (int i = chunkFirst; i < chunkLast; ++i)
+		{
+			const std::size_t p = pos + 2 * (std::size_t)(i - first);
+			const RadiusDraw draw = InitH2(i, _stars[p]);
+			_radius.Set(p, draw);
+
+			// Push particle again with type 4 (bright red core of an h2 region)
+			_stars[p + 1] = _stars[p];
+			_stars[p + 1].type = 4;
+			_radius.Set(p + 1, draw);
+		}
 
-	for (int i = 0; i < _numH2; ++i)
+		Derive(_stars.data(), _radius, pos + 2 * (std::size_t)(chunkFirst - first), pos + 2 * (std::size_t)(chunkLast - first), dfAll);
+	});
+}
+
+/** \brief Initializes the parameter independent fields of star number idx.
+	Its radius is draw 0 (see GenerateStars).
+	\param draws Random draws 0..3 of the star; draw d is at draws[d * stride]
+*/
+void Galaxy::InitStar(int idx, const float* draws, int stride, Star& star) const
+{
+	star.theta0 = 360.0f * draws[stride];
+	star.temp = 6000 + (4000 * draws[2 * stride] - 2000);
+	star.mag = 0.1f + 0.4f * draws[3 * stride];
+	star.type = 0;
+
+	// Make a small portion of the stars brighter. Decided by a draw and not
+	// by the index so that adding or removing stars keeps the others as
+	// they are.
+	auto rnum = CounterRandom(_seed, rsStars).At(idx, 4);
+	if (rnum() < 1.0f / 60.0f)
+	{
+		star.mag = std::min(star.mag + 0.1f + rnum() * 0.4f, 1.0f);
+	}
+}
+
+/** \brief Initializes the parameter independent fields of dust particle
+	number idx and returns its radius draw.
+*/
+Galaxy::RadiusDraw Galaxy::InitDust(int idx, Star& dustParticle) const
+{
+	// Even and odd particles follow different distributions. With quasi
+	// random numbers each half is a sequence of its own, otherwise the
+	// halves would sample every second point of a single sequence.
+	float u[4];
+	if (_quasiRandom)
 	{
-		x = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-		y = 2 * _radGalaxy * Helper::rnum() - _radGalaxy;
-		rad = sqrt(x * x + y * y);
-
-		auto particleH2 = Star();
-		particleH2.a = rad;
-		particleH2.b = rad * GetExcentricity(rad);
-		particleH2.tiltAngle = GetAngularOffset(rad);
-		particleH2.theta0 = 360.0f * Helper::rnum();
-		particleH2.velTheta = GetOrbitalVelocity((particleH2.a + particleH2.b) / 2.0f);
-		particleH2.temp = 6000 + (6000 * Helper::rnum()) - 3000;
-		particleH2.mag = 0.1f + 0.05f * Helper::rnum();
-		particleH2.type = 3;
-
-		_stars.push_back(particleH2);
-
-		// Push particle again with type 4 (bright red core of an h2 region)
-		particleH2.type = 4;
-		_stars.push_back(particleH2);
+		const QuasiRandom qrnd(_seed, rsDust + (idx % 2) * rsCount);
+		for (int d = 0; d < 4; ++d)
+			u[d] = qrnd(idx / 2, d);
 	}
+	else
+	{
+		auto rnum = CounterRandom(_seed, rsDust).At(idx);
+		for (float& v : u)
+			v = rnum();
+	}
+
+	RadiusDraw draw;
+	const float* next = u;
+	if (idx % 2 == 0)
+	{
+		draw = { *next++, 0, rmCdf };
+	}
+	else
+	{
+		// uniform in the square enclosing the galaxy
+		float x = 2 * *next++ - 1;
+		float y = 2 * *next++ - 1;
+		draw = { std::sqrt(x * x + y * y), 0, rmScaled };
+	}
+
+	dustParticle.theta0 = 360.0f * *next++;
+	dustParticle.type = 1;
+	dustParticle.mag = 0.02f + 0.15f * *next++;
+	return draw;
+}
+
+/** \brief Appends the particles of filament number idx and their radius draws. */
+void Galaxy::AddFilament(int idx, std::vector<Star>& filament, RadiusDraws& draws) const
+{
+	// draws 0..3 define the filament, particle i uses draws 4 + 3i ... 6 + 3i
+	auto rnum = CounterRandom(_seed, rsFilaments).At(idx);
+
+	float x = 2 * rnum() - 1;
+	float y = 2 * rnum() - 1;
+	float rad = std::sqrt(x * x + y * y);
+
+	auto theta = 360.0f * rnum();
+	auto mag = 0.1f + 0.05f * rnum();
+	auto num = (int)(100 * rnum());
+
+	// the filament is a random walk in radius starting at rad
+	float walk = 0;
+	for (int i = 0; i < num; ++i)
+	{
+		walk = walk + 200 - 400 * rnum();
+		auto dustParticle = Star();
+		dustParticle.theta0 = theta + 10 - 20 * rnum();
+		dustParticle.mag = mag + 0.025f * rnum();
+		dustParticle.type = 2;
+		filament.push_back(dustParticle);
+		draws.Push({ rad, walk, rmScaled });
+	}
+}
+
+/** \brief Initializes the parameter independent fields of H2 region number
+	idx and returns its radius draw.
+*/
+Galaxy::RadiusDraw Galaxy::InitH2(int idx, Star& particleH2) const
+{
+	auto rnum = CounterRandom(_seed, rsH2).At(idx);
+
+	float x = 2 * rnum() - 1;
+	float y = 2 * rnum() - 1;
+	const RadiusDraw draw = { std::sqrt(x * x + y * y), 0, rmScaled };
+
+	particleH2.theta0 = 360.0f * rnum();
+	particleH2.temp = 6000 + (6000 * rnum()) - 3000;
+	particleH2.mag = 0.1f + 0.05f * rnum();
+	particleH2.type = 3;
+	return draw;
 }
 
 bool Galaxy::HasBar() const noexcept
@@ -239,19 +878,34 @@ float Galaxy::GetBarEx() const noexcept
 void Galaxy::SetBarEnabled(bool on)
 {
 	_hasBar = on;
-	InitStarsAndDust();
+	Invalidate(dfShape | dfTilt);
 }
 
 void Galaxy::SetBarRadius(float rad)
 {
 	_barRadius = std::clamp(rad, 100.0f, _radCore);
-	InitStarsAndDust();
+	Invalidate(dfShape | dfTilt);
 }
 
 void Galaxy::SetBarEx(float ex)
 {
 	_barEx = std::clamp(ex, 0.1f, 1.0f);
-	InitStarsAndDust();
+	Invalidate(dfShape);
+}
+
+bool Galaxy::IsQuasiRandom() const noexcept
+{
+	return _quasiRandom;
+}
+
+void Galaxy::SetQuasiRandom(bool on)
+{
+	if (on == _quasiRandom)
+		return;
+
+	_quasiRandom = on;
+	_rebuildPending = true;
+	Invalidate(dfNone);
 }
 
 float Galaxy::GetBaseTemp() const noexcept
@@ -262,7 +916,7 @@ float Galaxy::GetBaseTemp() const noexcept
 void Galaxy::SetBaseTemp(float baseTemp)
 {
 	_baseTemp = baseTemp;
-	InitStarsAndDust();
+	Invalidate(dfTemp);
 }
 
 void Galaxy::SetDustRenderSize(float sz)
@@ -275,6 +929,22 @@ const std::vector<Star>& Galaxy::GetStars() const
 	return _stars;
 }
 
+const Galaxy::Layout& Galaxy::GetLayout() const noexcept
+{
+	return _layout;
+}
+
+const Galaxy::BuildStats& Galaxy::GetBuildStats() const noexcept
+{
+	return _buildStats;
+}
+
+void Galaxy::SetNumThreads(int n)
+{
+	_numThreads = n;
+	_workers.reset();
+}
+
 float Galaxy::GetDustRenderSize() const
 {
 	return _dustRenderSize;
@@ -298,7 +968,7 @@ float Galaxy::GetFarFieldRad() const
 void Galaxy::SetAngularOffset(float offset)
 {
 	_angleOffset = offset;
-	InitStarsAndDust();
+	Invalidate(dfTilt);
 }
 
 /** \brief Returns the orbital velocity in degrees per year.
@@ -325,46 +995,37 @@ float Galaxy::GetOrbitalVelocity(float rad) const
 
 float Galaxy::GetExcentricity(float r) const
 {
-	// NOTE: the star shader mirrors this profile in GLSL (VertexBufferStars,
-	// excentricity()); both must be changed in lockstep.
-	if (r < _radCore)
-	{
-		if (_hasBar && _barRadius > 0)
-		{
-			// Barred core: strongly elongated orbits out to the bar end,
-			// then blending back into the regular core value.
-			if (r < _barRadius)
-				return 1 + (r / _barRadius) * (_barEx - 1);
-			return _barEx + (r - _barRadius) / (_radCore - _barRadius) * (_elEx1 - _barEx);
-		}
-
-		// Core region of the galaxy. Innermost part is round
-		// excentricity increasing linear to the border of the core.
-		return 1 + (r / _radCore) * (_elEx1 - 1);
-	}
-	else if (r > _radCore && r <= _radGalaxy)
-	{
-		return _elEx1 + (r - _radCore) / (_radGalaxy - _radCore) * (_elEx2 - _elEx1);
-	}
-	else if (r > _radGalaxy && r < _radFarField)
-	{
-		// excentricity is slowly reduced to 1.
-		return _elEx2 + (r - _radGalaxy) / (_radFarField - _radGalaxy) * (1 - _elEx2);
-	}
-	else
-		return 1;
+	return RadialProfile::Excentricity(GetProfileParam(), r);
 }
 
 float Galaxy::GetAngularOffset(float rad) const
 {
-	// Inside the bar all orbits share the orientation of the bar-end orbit,
-	// so the inner ellipses line up into a bar instead of twisting into a
-	// spiral. C0-continuous at the bar end where the arms peel off.
-	// Mirrored in GLSL as tiltAt() (VertexBufferStars).
-	if (_hasBar && rad < _barRadius)
-		return _barRadius * _angleOffset;
+	return RadialProfile::Tilt(GetProfileParam(), rad);
+}
+
+RadialProfile::Param Galaxy::GetProfileParam() const
+{
+	RadialProfile::Param param;
+	param.radCore = _radCore;
+	param.radGalaxy = _radGalaxy;
+	param.radFarField = _radFarField;
+	param.exInner = _elEx1;
+	param.exOuter = _elEx2;
+	param.angleOffset = _angleOffset;
+	param.barRadius = (_hasBar) ? _barRadius : 0.0f;
+	param.barEx = _barEx;
+	param.hasDarkMatter = _hasDarkMatter;
+	return param;
+}
 
-	return rad * _angleOffset;
+/** \brief The radial profiles of the current parameters.
+
+	Tabulated on first use after a parameter change (see RadialProfile).
+*/
+const RadialProfile& Galaxy::GetRadialProfile() const
+{
+	_profile.Setup(GetProfileParam());
+	return _profile;
 }
 
 float Galaxy::GetAngularOffset() const
@@ -423,41 +1084,150 @@ int Galaxy::GetNumH2() const
 void Galaxy::SetNumStars(int n)
 {
 	_numStars = std::max(0, n);
-	InitStarsAndDust();
+	Invalidate(dfNone);
 }
 
 void Galaxy::SetNumDust(int n)
 {
 	_numDust = std::max(0, n);
-	InitStarsAndDust();
+	Invalidate(dfNone);
 }
 
 void Galaxy::SetNumH2(int n)
 {
 	_numH2 = std::max(0, n);
-	InitStarsAndDust();
+	Invalidate(dfNone);
+}
+
+// The particle counts are changed in place: particle i of a class does not
+// depend on the number of particles, so growing a class appends particles to
+// its block and shrinking it truncates the block. The changes are reported
+// through GetChanges().
+
+void Galaxy::ResizeStars()
+{
+	const int n = _numStars;
+	if (n == _builtStars)
+		return;
+
+	const auto t = Clock::now();
+	const int num = _builtStars;
+	if (n > num)
+	{
+		_stars.insert(_stars.begin() + num, (std::size_t)(n - num), Star());
+		_radius.Insert(num, (std::size_t)(n - num));
+		GenerateStars(num, n, num);
+		AddChange(num, 0, n - num);
+	}
+	else
+	{
+		_stars.erase(_stars.begin() + n, _stars.begin() + num);
+		_radius.Erase(n, num);
+		AddChange(n, num - n, 0);
+	}
+	_builtStars = n;
+
+	_buildStats.msStars += MsSince(t);
+}
+
+void Galaxy::ResizeDust()
+{
+	const int n = _numDust;
+	if (n == _builtDust)
+		return;
+
+	auto t = Clock::now();
+	const std::size_t dustOffset = GetDustOffset();
+	const int num = _builtDust;
+	if (n > num)
+	{
+		_stars.insert(_stars.begin() + dustOffset + num, (std::size_t)(n - num), Star());
+		_radius.Insert(dustOffset + num, (std::size_t)(n - num));
+		GenerateDust(num, n, dustOffset + num);
+		AddChange(dustOffset + num, 0, n - num);
+	}
+	else
+	{
+		_stars.erase(_stars.begin() + dustOffset + n, _stars.begin() + dustOffset + num);
+		_radius.Erase(dustOffset + n, dustOffset + num);
+		AddChange(dustOffset + n, num - n, 0);
+	}
+	_builtDust = n;
+	_buildStats.msDust += MsSince(t);
+
+	// one filament per 100 dust particles
+	t = Clock::now();
+	const int numFilaments = (int)_filamentOffsets.size() - 1;
+	const int newFilaments = n / 100;
+	const std::size_t filamentOffset = GetFilamentOffset();
+	const std::size_t oldEnd = _filamentOffsets.back();
+	if (newFilaments > numFilaments)
+	{
+		std::vector<Star> filaments;
+		RadiusDraws filamentDraws;
+		GenerateFilaments(numFilaments, newFilaments, filaments, filamentDraws);
+		_stars.insert(_stars.begin() + filamentOffset + oldEnd, filaments.begin(), filaments.end());
+		_radius.Insert(filamentOffset + oldEnd, filamentDraws);
+		AddChange(filamentOffset + oldEnd, 0, filaments.size());
+	}
+	else if (newFilaments < numFilaments)
+	{
+		_filamentOffsets.resize(newFilaments + 1);
+		const std::size_t newEnd = _filamentOffsets.back();
+		_stars.erase(_stars.begin() + filamentOffset + newEnd, _stars.begin() + filamentOffset + oldEnd);
+		_radius.Erase(filamentOffset + newEnd, filamentOffset + oldEnd);
+		AddChange(filamentOffset + newEnd, oldEnd - newEnd, 0);
+	}
+	_buildStats.msFilaments += MsSince(t);
+}
+
+void Galaxy::ResizeH2()
+{
+	const int n = _numH2;
+	if (n == _builtH2)
+		return;
+
+	const auto t = Clock::now();
+	const std::size_t h2Offset = GetH2Offset();
+	const int num = _builtH2;
+	if (n > num)
+	{
+		_stars.resize(_stars.size() + 2 * (std::size_t)(n - num));
+		_radius.Resize(_stars.size());
+		GenerateH2(num, n, h2Offset + 2 * (std::size_t)num);
+		AddChange(h2Offset + 2 * num, 0, 2 * (std::size_t)(n - num));
+	}
+	else
+	{
+		_stars.resize(h2Offset + 2 * (std::size_t)n);
+		_radius.Resize(_stars.size());
+		AddChange(h2Offset + 2 * n, 2 * (std::size_t)(num - n), 0);
+	}
+	_builtH2 = n;
+
+	_buildStats.msH2 += MsSince(t);
 }
 
 void Galaxy::SetRad(float rad)
 {
 	_radGalaxy = rad;
-	InitStarsAndDust();
+	Invalidate(dfRadius);
 }
 
 void Galaxy::SetCoreRad(float rad)
 {
 	_radCore = rad;
-	InitStarsAndDust();
+	Invalidate(dfRadius);
 }
 
 void Galaxy::SetExInner(float ex)
 {
 	_elEx1 = ex;
-	InitStarsAndDust();
+	Invalidate(dfShape);
 }
 
 void Galaxy::SetExOuter(float ex)
 {
 	_elEx2 = ex;
-	InitStarsAndDust();
+	Invalidate(dfShape);
 }
@@ -0,0 +1,144 @@
+#include "GalaxyBuilder.hpp"
+
+#include <algorithm>
+
+
+GalaxyBuilder::GalaxyBuilder()
+	: _work()
+	, _cancel(false)
+	, _shutdown(false)
+	, _request()
+	, _requestDetail(1)
+	, _requestId(0)
+	, _numThreads(0)
+	, _result()
+	, _resultChanges()
+	, _resultLayout()
+	, _resultStats()
+	, _resultDetail(1)
+	, _resultId(0)
+	, _hasResult(false)
+	, _resultTime()
+	, _thread()
+{
+	_work.SetDeferredUpdate(true);
+	_work.SetCancelFlag(&_cancel);
+	_thread = std::thread(&GalaxyBuilder::BuilderMain, this);
+}
+
+GalaxyBuilder::~GalaxyBuilder()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_shutdown = true;
+		_cancel = true;
+	}
+	_cv.notify_all();
+	_thread.join();
+}
+
+void GalaxyBuilder::SetNumThreads(int n)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_numThreads = n;
+}
+
+void GalaxyBuilder::Submit(const Galaxy& galaxy, float detail)
+{
+	detail = std::clamp(detail, 0.0f, 1.0f);
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_request = galaxy.GetSnapshot();
+		_request.param.numStars = (int)(_request.param.numStars * detail);
+		_request.param.numDust = (int)(_request.param.numDust * detail);
+		_requestDetail = detail;
+		++_requestId;
+
+		if (Clock::now() - _resultTime < std::chrono::milliseconds(MaxStaleMs))
+			_cancel = true;
+	}
+	_cv.notify_all();
+}
+
+bool GalaxyBuilder::Fetch(Galaxy& galaxy, float& detail)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_hasResult)
+		return false;
+
+	galaxy.SetPopulation(std::move(_result), _resultChanges, _resultLayout, _resultStats);
+	detail = _resultDetail;
+	_result = std::vector<Star>();
+	_resultChanges.clear();
+	_hasResult = false;
+	return true;
+}
+
+bool GalaxyBuilder::IsBusy() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _resultId != _requestId;
+}
+
+void GalaxyBuilder::BuilderMain()
+{
+	unsigned lastId = 0;
+	int numThreads = 0;
+	for (;;)
+	{
+		Galaxy::Snapshot request;
+		float detail = 1;
+		unsigned id = 0;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cv.wait(lock, [this, lastId]() { return _shutdown || _requestId != lastId; });
+			if (_shutdown)
+				return;
+
+			request = _request;
+			detail = _requestDetail;
+			id = _requestId;
+			_cancel = false;
+
+			if (_numThreads != numThreads)
+			{
+				numThreads = _numThreads;
+				_work.SetNumThreads(numThreads);
+			}
+		}
+		lastId = id;
+
+		// A cancelled update keeps its outstanding work, the next request
+		// continues from there.
+		_work.Apply(request);
+		if (!_work.Update())
+			continue;
+
+		if (_work.GetChanges().empty())
+		{
+			// e.g. only shader parameters changed
+			std::lock_guard<std::mutex> lock(_mutex);
+			_resultId = id;
+			_resultTime = Clock::now();
+			continue;
+		}
+
+		// Copy outside the lock, the UI thread may be waiting for it
+		std::vector<Star> stars(_work.GetStars());
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (const auto& change : _work.GetChanges())
+				Galaxy::AddChange(_resultChanges, change.first, change.removed, change.inserted, change.fields);
+
+			_result.swap(stars);
+			_resultLayout = _work.GetLayout();
+			_resultStats = _work.GetBuildStats();
+			_resultDetail = detail;
+			_resultId = id;
+			_hasResult = true;
+			_resultTime = Clock::now();
+		}
+		_work.ClearChanges();
+	}
+}
@@ -17,19 +17,29 @@
 #include "imgui_impl_sdl2.h"
 #include "imgui_impl_opengl3.h"
 
+#include "GlDebug.hpp"
+#include "GlState.hpp"
 #include "Helper.hpp"
 #include "Types.hpp"
 
 const float GalaxyWnd::TimeStepSize = 100000.0f;
+const float GalaxyWnd::PreviewBudgetMs = 10.0f;
+const float GalaxyWnd::MinPreviewDetail = 0.02f;
+const float GalaxyWnd::MinLevelOfDetail = 0.05f;
+const std::size_t GalaxyWnd::UploadChunkSize = 65536;
+const float GalaxyWnd::DustGridMag = 0.14f;   // light weighted mean of the dust magnitudes of Galaxy
+const float GalaxyWnd::DustGridSigma = 2.0f;
 
 GalaxyWnd::GalaxyWnd()
 	: SDLWindow()
 	, _flags((int)DisplayItem::STARS | (int)DisplayItem::AXIS | (int)DisplayItem::DUST | (int)DisplayItem::H2 | (int)DisplayItem::FILAMENTS)
 	, _galaxy()
+	, _builder()
+	, _uploadWorkers(new WorkerPool())
 	, _renderUpdateHint(ruhDENSITY_WAVES | ruhAXIS | ruhSTARS | ruhDUST | ruhCREATE_VELOCITY_CURVE)
-	, _vertDensityWaves(2)
+	, _vertDensityWaves(2, GL_STREAM_DRAW)
 	, _vertAxis()
-	, _vertVelocityCurve(1, GL_DYNAMIC_DRAW)
+	, _vertVelocityCurve(1, GL_STREAM_DRAW)
 	, _vertStars(GL_FUNC_ADD, GL_ONE)
 	, _textAxisLabel()
 	, _textGalaxyLabels()
@@ -38,6 +48,9 @@ GalaxyWnd::GalaxyWnd()
 	, _videoHeight(2160)
 	, _videoFps(60)
 {
+	// _galaxy holds the parameters and the population on display; the
+	// population itself is built in the background by _builder.
+	_galaxy.SetDeferredUpdate(true);
 }
 
 void GalaxyWnd::LoadPresets()
@@ -101,6 +114,7 @@ void GalaxyWnd::LoadPresets()
 				else if (key == "hasBar")         p.hasBar = val != 0;
 				else if (key == "barRadius")      p.barRadius = val;
 				else if (key == "barEx")          p.barEx = val;
+				else if (key == "quasiRandom")    p.quasiRandom = val != 0;
 				else if (key == "showStars")         displayFlag(DisplayItem::STARS);
 				else if (key == "showAxis")          displayFlag(DisplayItem::AXIS);
 				else if (key == "showDust")          displayFlag(DisplayItem::DUST);
@@ -208,6 +222,7 @@ bool GalaxyWnd::SavePreset(const std::string& name)
 	file << "hasBar=" << (_galaxy.HasBar() ? 1 : 0) << "\n";
 	file << "barRadius=" << _galaxy.GetBarRadius() << "\n";
 	file << "barEx=" << _galaxy.GetBarEx() << "\n";
+	file << "quasiRandom=" << (_galaxy.IsQuasiRandom() ? 1 : 0) << "\n";
 	file << "showStars=" << ((_flags & (uint32_t)DisplayItem::STARS) ? 1 : 0) << "\n";
 	file << "showAxis=" << ((_flags & (uint32_t)DisplayItem::AXIS) ? 1 : 0) << "\n";
 	file << "showDust=" << ((_flags & (uint32_t)DisplayItem::DUST) ? 1 : 0) << "\n";
@@ -226,6 +241,12 @@ void GalaxyWnd::SetVideoOptions(int width, int height, int fps)
 	_videoFps = fps;
 }
 
+void GalaxyWnd::SetNumThreads(int n)
+{
+	_builder.SetNumThreads(n);
+	_uploadWorkers.reset(new WorkerPool(n));
+}
+
 GalaxyWnd::~GalaxyWnd()
 {
 	// Shut down Dear ImGui while the GL context is still valid (before the
@@ -239,6 +260,13 @@ GalaxyWnd::~GalaxyWnd()
 	_vertAxis.Release();
 	_vertVelocityCurve.Release();
 	_vertStars.Release();
+	for (SceneLayers* layers : { &_layersWnd, &_layersVideo })
+	{
+		layers->reduced.Release();
+		layers->dustGrid.Release();
+	}
+
+	_rings.Release();
 }
 
 void GalaxyWnd::InitGL() noexcept(false)
@@ -255,7 +283,7 @@ void GalaxyWnd::InitGL() noexcept(false)
 	_textAxisLabel.Initialize();
 	_textGalaxyLabels.Initialize();
 
-	glDisable(GL_DEPTH_TEST);
+	GlState::Disable(GL_DEPTH_TEST);
 	glClearColor(0.0f, .0f, 0.08f, 0.0f);
 	SetCameraOrientation({ 0, 1, 0 });
 
@@ -287,33 +315,116 @@ void GalaxyWnd::InitSimulation()
 			4000 });
 }
 
-void GalaxyWnd::UpdateStars()
+/** \brief The attribute streams of _vertStars holding the given star fields
+	(Galaxy::DerivedField bits).
+*/
+uint32_t GalaxyWnd::StreamsOfFields(uint32_t fields)
 {
-	std::vector<VertexStar> vert;
-	std::vector<int> idx;
+	// Everything depends on the radius
+	if (fields & Galaxy::dfRadius)
+		return (1u << VertexBufferStars::NumStreams) - 1;
+
+	uint32_t streams = 0;
+	if (fields & Galaxy::dfVelocity)
+		streams |= 1u << VertexBufferStars::stVelocity;
+
+	if (fields & Galaxy::dfTemp)
+		streams |= 1u << VertexBufferStars::stLook;
+
+	if (fields & Galaxy::dfShape)
+		streams |= 1u << VertexBufferStars::stAxes;
+
+	if (fields & Galaxy::dfTilt)
+		streams |= 1u << VertexBufferStars::stTilt;
+
+	return streams;
+}
 
+void GalaxyWnd::UpdateStars()
+{
+	// The galaxy reports which parts of the population changed since the last
+	// update. Replay the structural changes on the vertex buffer first, then
+	// write the final content of every range that was touched. Buffer index
+	// i is particle i of the galaxy.
 	const auto& stars = _galaxy.GetStars();
+	const auto& changes = _galaxy.GetChanges();
+	if (!changes.empty())
+		_ringsDirty = true;
 
-	float a = 1;
-	Color color = { 1, 1, 1, a };
+	for (const auto& change : changes)
+		_vertStars.Splice(change.first, change.removed, change.inserted, GL_POINTS);
 
-	for (int i = 1; i < stars.size(); ++i)
+	// The vertices are written by the upload workers straight into the mapped
+	// buffers; there is no staging copy. Only the attribute streams holding
+	// the fields a change refreshed are written.
+	for (const auto& change : changes)
 	{
-		const Color& col = Helper::ColorFromTemperature(stars[i].temp);
-		color = { col.r, col.g, col.b, a };
+		const std::size_t first = std::min(change.dataFirst, stars.size());
+		const std::size_t count = std::min(change.dataFirst + change.dataCount, stars.size()) - first;
+		const uint32_t streams = StreamsOfFields(change.fields);
+
+		_vertStars.FillStreams(streams, first, count, [&](void* const* mem)
+		{
+			const int numChunks = (int)((count + UploadChunkSize - 1) / UploadChunkSize);
+			_uploadWorkers->ParallelFor(numChunks, [&](int chunk)
+			{
+				const std::size_t begin = chunk * UploadChunkSize;
+				const std::size_t end = std::min(begin + UploadChunkSize, count);
 
-		idx.push_back((int)vert.size());
-		vert.push_back({ stars[i], color });
+				// Converted in small batches that stay in the cache
+				constexpr std::size_t BatchSize = 256;
+				VertexStar vert[BatchSize];
+				for (std::size_t batch = begin; batch < end; batch += BatchSize)
+				{
+					const std::size_t num = std::min(BatchSize, end - batch);
+					VertexStar::FromStars(&stars[first + batch], num, vert);
+					for (std::size_t i = 0; i < num; ++i)
+						VertexBufferStars::WriteVertex(mem, streams, batch + i, vert[i]);
+				}
+			});
+		});
 	}
 
-	_vertStars.CreateBuffer(vert, idx, GL_POINTS);
-	_renderUpdateHint &= ~ruhSTARS;
+	// The shells depend on the orbit axes; Splice drops the draw order
+	bool reorder = !_vertStars.HasDrawOrder();
+	for (const auto& change : changes)
+		reorder |= (change.fields & (Galaxy::dfRadius | Galaxy::dfShape)) != 0;
+
+	if (reorder)
+		UpdateDrawOrder();
+
+	_galaxy.ClearChanges();
+}
+
+/** \brief Sorts the particles of each class into radial shells (see
+	VertexBufferStars::SortIntoShells) and sets the result as draw order of
+	the star buffer.
+*/
+void GalaxyWnd::UpdateDrawOrder()
+{
+	const auto& stars = _galaxy.GetStars();
+	const auto& layout = _galaxy.GetLayout();
+	const std::size_t classSize[] = { layout.numStars, layout.numDust, layout.numFilaments, layout.numH2 };
+
+	std::size_t classFirst[VertexBufferStars::NumParticleClasses] = {};
+	for (int cls = 1; cls < VertexBufferStars::NumParticleClasses; ++cls)
+		classFirst[cls] = classFirst[cls - 1] + classSize[cls - 1];
+
+	std::vector<GLuint> order(stars.size());
+	VertexBufferStars::Shells shells[VertexBufferStars::NumParticleClasses];
+	_uploadWorkers->ParallelFor(VertexBufferStars::NumParticleClasses, [&](int cls)
+	{
+		VertexBufferStars::SortIntoShells(stars.data(), classFirst[cls], classSize[cls], order.data(), shells[cls]);
+	});
+
+	_vertStars.SetDrawOrder(order);
+	for (int cls = 0; cls < VertexBufferStars::NumParticleClasses; ++cls)
+		_vertStars.SetShells((VertexBufferStars::ParticleClass)cls, shells[cls]);
 }
 
 void GalaxyWnd::UpdateAxis()
 {
 	std::vector<VertexColor> vert;
-	std::vector<int> idx;
 
 	GLfloat s = (GLfloat)std::pow(10, (int)(std::log10(_fov / 2)));
 	GLfloat l = _fov / 100, p = 0;
@@ -322,44 +433,26 @@ void GalaxyWnd::UpdateAxis()
 	for (int i = 0; p < _fov; ++i)
 	{
 		p += s;
-		idx.push_back((int)vert.size());
 		vert.push_back({ p, -l, 0, r, g, b, a });
-
-		idx.push_back((int)vert.size());
 		vert.push_back({ p,  l, 0, r, g, b, a });
 
-		idx.push_back((int)vert.size());
 		vert.push_back({ -p, -l, 0, r, g, b, a });
-
-		idx.push_back((int)vert.size());
 		vert.push_back({ -p,  0, 0, r, g, b, a });
 
-		idx.push_back((int)vert.size());
 		vert.push_back({ -l, p, 0, r, g, b, a });
-
-		idx.push_back((int)vert.size());
 		vert.push_back({ 0, p, 0, r, g, b, a });
 
-		idx.push_back((int)vert.size());
 		vert.push_back({ -l, -p, 0, r, g, b, a });
-
-		idx.push_back((int)vert.size());
 		vert.push_back({ 0, -p, 0, r, g, b, a });
 	}
 
-	idx.push_back((int)vert.size());
 	vert.push_back({ -_fov, 0, 0, r, g, b, a });
-
-	idx.push_back((int)vert.size());
 	vert.push_back({ _fov, 0, 0, r, g, b, a });
 
-	idx.push_back((int)vert.size());
 	vert.push_back({ 0, -_fov, 0, r, g, b, a });
-
-	idx.push_back((int)vert.size());
 	vert.push_back({ 0, _fov, 0, r, g, b, a });
 
-	_vertAxis.CreateBuffer(vert, idx, GL_LINES);
+	_vertAxis.CreateBuffer(vert, GL_LINES);
 
 	//
 	// Update Axis Labels
@@ -395,23 +488,18 @@ void GalaxyWnd::UpdateVelocityCurve()
 	std::vector<VertexColor> vert;
 	vert.reserve(1000);
 
-	std::vector<int> idx;
-	idx.reserve(1000);
-
 	float dt_in_sec = GalaxyWnd::TimeStepSize * Helper::SEC_PER_YEAR;
 	float r = 0, v = 0;
 	float cr = 0.5, cg = 1, cb = 1, ca = 1;
 	for (int r = 0; r < _galaxy.GetFarFieldRad(); r += 100)
 	{
-		idx.push_back((int)vert.size());
-
 		if (_galaxy.HasDarkMatter())
 			vert.push_back({ (float)r, Helper::VelocityWithDarkMatter((float)r) * 10.f, 0,  cr, cg, cb, ca });
 		else
 			vert.push_back({ (float)r, Helper::VelocityWithoutDarkMatter((float)r) * 10.f, 0,  cr, cg, cb, ca });
 	}
 
-	_vertVelocityCurve.CreateBuffer(vert, idx, GL_POINTS);
+	_vertVelocityCurve.CreateBuffer(vert, GL_POINTS);
 	_renderUpdateHint &= ~ruhCREATE_VELOCITY_CURVE;
 }
 
@@ -483,8 +571,37 @@ void GalaxyWnd::Update()
 	if ((_renderUpdateHint & ruhAXIS) != 0)
 		UpdateAxis();
 
+	// The previous population stays on display until the builder has the
+	// new one ready. While a widget is dragged only a preview with a fraction
+	// of the particles is built; the full population follows on release.
+	const bool dragging = _showUi && ImGui::IsAnyItemActive();
 	if ((_renderUpdateHint & ruhSTARS) != 0)
+	{
+		_submittedDetail = (dragging) ? _previewDetail : 1.0f;
+		_builder.Submit(_galaxy, _submittedDetail);
+		_renderUpdateHint &= ~ruhSTARS;
+	}
+	else if (!dragging && _submittedDetail < 1)
+	{
+		_submittedDetail = 1;
+		_builder.Submit(_galaxy, _submittedDetail);
+	}
+
+	float detail = 1;
+	if (_builder.Fetch(_galaxy, detail))
+	{
 		UpdateStars();
+		_populationGain = 1.0f / std::max(detail, MinPreviewDetail);
+
+		// Steer the preview detail towards the time budget. Trivial builds
+		// (e.g. no particle changed) say nothing about the cost.
+		const auto& stats = _galaxy.GetBuildStats();
+		if (detail < 1 && stats.msTotal > 0.5)
+		{
+			const float ideal = detail * PreviewBudgetMs / (float)stats.msTotal;
+			_previewDetail = std::clamp(0.5f * (_previewDetail + ideal), MinPreviewDetail, 1.0f);
+		}
+	}
 
 	if ((_renderUpdateHint & ruhCREATE_VELOCITY_CURVE) != 0)
 		UpdateVelocityCurve();
@@ -519,8 +636,10 @@ void GalaxyWnd::Render()
 			-l, l,
 			-l, l);
 
+		// Videos are always rendered in full detail
 		_vertStars.SetSizeFactor((float)_videoRecorder.GetHeight() / (float)_height);
-		RenderScene(_matView, matProjVideo, false);
+		UpdateDrawRanges(1.0f);
+		RenderScene(_matView, matProjVideo, false, _layersVideo);
 		_vertStars.SetSizeFactor(1.0f);
 
 		_videoRecorder.CaptureFrame();
@@ -530,7 +649,8 @@ void GalaxyWnd::Render()
 	}
 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	RenderScene(_matView, _matProjection, true);
+	UpdateDrawRanges(_lod);
+	RenderScene(_matView, _matProjection, true, _layersWnd);
 
 	// Dear ImGui overlay (window pass only, never in the video framebuffer).
 	ImGui_ImplOpenGL3_NewFrame();
@@ -540,6 +660,9 @@ void GalaxyWnd::Render()
 	ImGui::Render();
 	ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
+	// Dear ImGui sets its own state
+	GlState::Invalidate();
+
 	SDL_GL_SwapWindow(_pSdlWnd);
 
 	// Optionally cap the render loop to the target framerate.
@@ -554,7 +677,57 @@ void GalaxyWnd::Render()
 	{
 		SDL_Delay(1);
 	}
-	_lastFrameTicks = SDL_GetTicks();
+
+	const Uint32 ticks = SDL_GetTicks();
+	if (_lastFrameTicks != 0)
+		AdaptLevelOfDetail((float)(ticks - _lastFrameTicks));
+
+	_lastFrameTicks = ticks;
+}
+
+/** \brief Draws only the fraction lod of the stars, dust and filaments.
+
+	The particles of a class are independent samples in no particular order
+	(see Galaxy::Layout), so drawing the first ones of each class thins the
+	galaxy out evenly. Their brightness is scaled up to keep its overall
+	light. The few H2 regions are always drawn.
+*/
+void GalaxyWnd::UpdateDrawRanges(float lod)
+{
+	lod = std::min(lod, 1.0f);
+	_vertStars.SetBrightnessGain(_populationGain / lod);
+
+	const auto& layout = _galaxy.GetLayout();
+	const std::size_t classSize[] = { layout.numStars, layout.numDust, layout.numFilaments, layout.numH2 };
+
+	std::size_t offset = 0;
+	for (int cls = 0; cls < VertexBufferStars::NumParticleClasses; ++cls)
+	{
+		// H2 regions are few and always drawn in full
+		const std::size_t n = classSize[cls];
+		const float detail = (cls == VertexBufferStars::pcH2) ? 1.0f : lod;
+		_vertStars.SetClassRange((VertexBufferStars::ParticleClass)cls, (GLint)offset, (GLsizei)n, detail);
+		offset += n;
+	}
+}
+
+/** \brief Steers the automatic level of detail towards the target framerate.
+
+	The frame time includes the wait of the framerate limiter: a frame that
+	was ready early counts as fast enough and the detail grows back to 1.
+*/
+void GalaxyWnd::AdaptLevelOfDetail(float frameMs)
+{
+	_frameMs = (_frameMs == 0) ? frameMs : 0.9f * _frameMs + 0.1f * frameMs;
+	if (!_autoLod)
+		return;
+
+	const int fps = (_limitFramerate && _targetFps > 0) ? _targetFps : 60;
+	const float budgetMs = 1000.0f / fps;
+	if (_frameMs > 1.15f * budgetMs)
+		_lod = std::max(0.95f * _lod, MinLevelOfDetail);
+	else if (_frameMs < 1.05f * budgetMs)
+		_lod = std::min(1.02f * _lod, 1.0f);
 }
 
 void GalaxyWnd::RenderUI()
@@ -648,11 +821,28 @@ void GalaxyWnd::RenderUI()
 		return open;
 	};
 	auto endSection = []() { ImGui::PopID(); ImGui::PopStyleColor(9); };
+	auto dustResolutionCombo = [](const char* label, LowResLayer& layer)
+	{
+		int idx = (layer.GetDownscale() >= 4) ? 2 : layer.GetDownscale() - 1;
+		if (ImGui::Combo(label, &idx, "Full\0Half\0Quarter\0"))
+			layer.SetDownscale(1 << idx);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Dust and filaments drawn at a reduced resolution.\nSaves most of their fill rate; they are blurry anyway.");
+	};
 
 	ImGui::Text("%d FPS", GetFPS());
 	ImGui::SameLine();
 	ImGui::TextDisabled("(F1 toggles this panel)");
 
+	const unsigned glErrors = GlDebug::GetNumErrors();
+	const unsigned glPerfWarnings = GlDebug::GetNumPerfWarnings();
+	if (glErrors + glPerfWarnings > 0)
+	{
+		ImGui::TextColored(ImVec4(1.0f, 0.4f, 0.4f, 1.0f), "OpenGL: %u errors, %u performance warnings", glErrors, glPerfWarnings);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Reported by the driver; the messages are printed to the console.");
+	}
+
 	// --- Geometry (applied live while dragging) ---------------------------
 	if (beginSection("Geometry", ImVec4(0.15f, 0.30f, 0.55f, 1.0f)))
 	{
@@ -762,12 +952,63 @@ void GalaxyWnd::RenderUI()
 			_renderUpdateHint |= ruhSTARS | ruhDUST;
 		}
 
-		if (ImGui::SliderInt("H2 regions", &_ui.numH2, 0, 2000))
+		if (ImGui::SliderInt("H2 regions", &_ui.numH2, 0, 20000))
 		{
 			_galaxy.SetNumH2(_ui.numH2);
 			_renderUpdateHint |= ruhSTARS | ruhDUST;
 		}
 
+		bool quasiRandom = _galaxy.IsQuasiRandom();
+		if (ImGui::Checkbox("Quasi-random placement", &quasiRandom))
+		{
+			_galaxy.SetQuasiRandom(quasiRandom);
+			_renderUpdateHint |= ruhSTARS | ruhDUST;
+		}
+
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Place stars and dust clouds evenly (scrambled Sobol sequence).\nGives a smooth disc with fewer particles.");
+
+		const auto& stats = _galaxy.GetBuildStats();
+		if (_builder.IsBusy())
+			ImGui::TextDisabled("Building...");
+		else
+			ImGui::TextDisabled("Build time: %.1f ms (%d threads)", stats.msTotal, stats.numThreads);
+
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip(
+				"Stars:     %7.2f ms\n"
+				"Dust:      %7.2f ms\n"
+				"Filaments: %7.2f ms\n"
+				"H2:        %7.2f ms\n"
+				"Derive:    %7.2f ms",
+				stats.msStars, stats.msDust, stats.msFilaments, stats.msH2, stats.msDerive);
+
+		// Level of detail: drawing only part of the particles needs no rebuild
+		ImGui::Checkbox("Auto detail", &_autoLod);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Lower the detail while the framerate is below the target");
+
+		ImGui::BeginDisabled(_autoLod);
+		ImGui::SliderFloat("Detail", &_lod, MinLevelOfDetail, 1.0f, "%.2f");
+		ImGui::EndDisabled();
+		if (ImGui::IsItemHovered(ImGuiHoveredFlags_AllowWhenDisabled))
+			ImGui::SetTooltip("Fraction of the stars, dust and filaments drawn.\nTheir brightness is scaled to match.");
+
+		dustResolutionCombo("Dust resolution", _layersWnd.reduced);
+
+		int engine = _ringEngine ? 1 : 0;
+		if (ImGui::Combo("Render engine", &engine, "Particles\0Rings\0"))
+			_ringEngine = engine == 1;
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip(
+				"Rings: stars, dust and filaments are drawn as rotating rings\n"
+				"of a texture instead of one sprite each. The frame time no\n"
+				"longer depends on the number of particles.");
+
+		ImGui::Checkbox("Dust as density field", &_dustGrid);
+		if (ImGui::IsItemHovered())
+			ImGui::SetTooltip("Sums the dust clouds in a coarse grid and blurs it instead of\ndrawing their sprites. Much faster for large dust render sizes.");
+
 		float dustSize = _galaxy.GetDustRenderSize();
 		if (ImGui::SliderFloat("Dust render size (px)", &dustSize, 1.0f, 200.0f, "%.0f"))
 			_galaxy.SetDustRenderSize(dustSize);   // cheap: no rebuild
@@ -920,6 +1161,7 @@ void GalaxyWnd::RenderUI()
 		ImGui::InputInt("Height", &_videoHeight);
 		ImGui::SliderInt("FPS", &_videoFps, 24, 120);
 		ImGui::EndDisabled();
+		dustResolutionCombo("Dust resolution", _layersVideo.reduced);
 		if (_videoWidth < 16)  _videoWidth = 16;
 		if (_videoHeight < 16) _videoHeight = 16;
 
@@ -938,7 +1180,7 @@ void GalaxyWnd::RenderUI()
 	ImGui::End();
 }
 
-void GalaxyWnd::RenderScene(glm::mat4& matView, glm::mat4& matProjection, bool overlays)
+void GalaxyWnd::RenderScene(glm::mat4& matView, glm::mat4& matProjection, bool overlays, SceneLayers& layers)
 {
 	if (_flags & (int)DisplayItem::AXIS)
 	{
@@ -967,19 +1209,114 @@ void GalaxyWnd::RenderScene(glm::mat4& matView, glm::mat4& matProjection, bool o
 
 	if (features != 0)
 	{
-		_vertStars.UpdateShaderVariables(_time, _galaxy.GetPertN(), _galaxy.GetPertAmp(), (int)_galaxy.GetDustRenderSize(), features);
+		// Orbits staying farther from the center than every corner of the
+		// view are outside of it. The largest point sprite may still reach
+		// into the view from outside.
+		const float halfWidth = 1.0f / matProjection[0][0];
+		const float halfHeight = 1.0f / matProjection[1][1];
+		const float centerX = -matProjection[3][0] * halfWidth;
+		const float centerY = -matProjection[3][1] * halfHeight;
+		const float maxPointSize = std::max({ 5.0f * _galaxy.GetDustRenderSize(), _h2SizeMax, 4.0f });
+		const float pointMargin = 0.5f * maxPointSize * 2 * std::abs(halfHeight) / (float)_height;
+		const float cullRadius = std::hypot(std::abs(centerX) + std::abs(halfWidth), std::abs(centerY) + std::abs(halfHeight)) + pointMargin;
+		_vertStars.SetCullRadius(cullRadius);
+
 		_vertStars.UpdateH2Params({
-			_galaxy.GetCoreRad(),
-			_galaxy.GetRad(),
-			_galaxy.GetFarFieldRad(),
-			_galaxy.GetExInner(),
-			_galaxy.GetExOuter(),
-			_galaxy.GetAngularOffset(),
 			_h2SizeMax,
 			_h2Threshold,
-			_galaxy.HasBar() ? _galaxy.GetBarRadius() : 0.0f,
-			_galaxy.GetBarEx() });
-		_vertStars.Draw(matView, matProjection);
+			_galaxy.HasBar() ? _galaxy.GetBarRadius() : 0.0f });
+		_vertStars.SetRadialProfile(_galaxy.GetRadialProfile());
+
+		const float sizeFactor = _vertStars.GetSizeFactor();
+		auto drawClasses = [&](int classes, glm::mat4 matProj)
+		{
+			_vertStars.UpdateShaderVariables(_time, _galaxy.GetPertN(), _galaxy.GetPertAmp(), (int)_galaxy.GetDustRenderSize(), classes);
+			_vertStars.Draw(matView, matProj);
+		};
+
+		const int starBit = 1 << VertexBufferStars::pcStars;
+		const int dustBit = 1 << VertexBufferStars::pcDust;
+		const int filamentBit = 1 << VertexBufferStars::pcFilaments;
+
+		// The ring engine draws stars, dust and filaments from textures that
+		// are splatted only when the population changes (see RingRenderer)
+		const int ringFeatures = _ringEngine ? features & (starBit | dustBit | filamentBit) : 0;
+		features &= ~ringFeatures;
+		if (ringFeatures != 0)
+		{
+			if (_rings.SetRadialProfile(_galaxy.GetRadialProfile()) || ringFeatures != _ringFeatures)
+				_ringsDirty = true;
+
+			if (_ringsDirty)
+			{
+				_vertStars.UpdateShaderVariables(_time, _galaxy.GetPertN(), _galaxy.GetPertAmp(), (int)_galaxy.GetDustRenderSize(), 0);
+				_rings.BeginSplat(RingRenderer::lrStars);
+				_vertStars.Splat(ringFeatures & starBit);
+				_rings.EndSplat();
+				_rings.BeginSplat(RingRenderer::lrDust);
+				_vertStars.Splat(ringFeatures & (dustBit | filamentBit));
+				_rings.EndSplat();
+				_ringFeatures = ringFeatures;
+				_ringsDirty = false;
+			}
+
+			// The texels hold the light of sprites of size factor 1 and dust
+			// size 1; the whole population is splatted, so the level of
+			// detail does not apply
+			const float dustSize = _galaxy.GetDustRenderSize();
+			const float gain = _populationGain * sizeFactor * sizeFactor;
+			if (ringFeatures & starBit)
+				_rings.Draw(RingRenderer::lrStars, matProjection, _time, _galaxy.GetPertN(), _galaxy.GetPertAmp(), gain);
+
+			if (ringFeatures & (dustBit | filamentBit))
+				_rings.Draw(RingRenderer::lrDust, matProjection, _time, _galaxy.GetPertN(), _galaxy.GetPertAmp(), gain * dustSize * dustSize);
+		}
+
+		// Dust optionally as a density field: the light of each cloud goes
+		// into a single cell of a coarse grid that is blurred by the spread
+		// of the sprite of a typical cloud. The cell size is chosen so the
+		// blur spans DustGridSigma cells.
+		const int gridFeatures = _dustGrid ? features & dustBit : 0;
+		features &= ~gridFeatures;
+		if (gridFeatures != 0)
+		{
+			// 0.39 radii is the standard deviation of the cone of a sprite
+			const float sigmaPx = 0.39f * 0.5f * 5.0f * DustGridMag * _galaxy.GetDustRenderSize() * sizeFactor;
+			const int downscale = std::clamp((int)std::lround(sigmaPx / DustGridSigma), 2, 32);
+
+			LowResLayer& grid = layers.dustGrid;
+			grid.SetDownscale(downscale);
+			grid.Begin((int)std::ceil(3 * sigmaPx / downscale));
+			_vertStars.SetSizeFactor(sizeFactor * grid.GetScale());
+			_vertStars.SetDustGrid(true);
+			drawClasses(gridFeatures, grid.AdjustProjection(matProjection));
+			_vertStars.SetDustGrid(false);
+			_vertStars.SetSizeFactor(sizeFactor);
+			grid.Blur(sigmaPx * grid.GetScale());
+			grid.End();
+		}
+
+		// Dust and filaments optionally go into the reduced resolution layer
+		// with point sizes scaled to cover the same area
+		const int layerFeatures = layers.reduced.IsEnabled() ? features & (dustBit | filamentBit) : 0;
+		features &= ~layerFeatures;
+		if (layerFeatures != 0)
+		{
+			layers.reduced.Begin();
+			_vertStars.SetSizeFactor(sizeFactor * layers.reduced.GetScale());
+			drawClasses(layerFeatures, matProjection);
+			_vertStars.SetSizeFactor(sizeFactor);
+			layers.reduced.End();
+		}
+
+		if (features != 0)
+			drawClasses(features, matProjection);
+
+		if (gridFeatures != 0)
+			layers.dustGrid.Composite();
+
+		if (layerFeatures != 0)
+			layers.reduced.Composite();
 	}
 
 	if (_flags & (int)DisplayItem::DENSITY_WAVES)
@@ -0,0 +1,139 @@
+#include "GlDebug.hpp"
+
+#include <iostream>
+
+
+namespace
+{
+	const char* SourceName(GLenum source)
+	{
+		switch (source)
+		{
+		case GL_DEBUG_SOURCE_API:             return "API";
+		case GL_DEBUG_SOURCE_WINDOW_SYSTEM:   return "window system";
+		case GL_DEBUG_SOURCE_SHADER_COMPILER: return "shader compiler";
+		case GL_DEBUG_SOURCE_THIRD_PARTY:     return "third party";
+		case GL_DEBUG_SOURCE_APPLICATION:     return "application";
+		default:                              return "other";
+		}
+	}
+
+	const char* TypeName(GLenum type)
+	{
+		switch (type)
+		{
+		case GL_DEBUG_TYPE_ERROR:               return "error";
+		case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return "deprecated";
+		case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return "undefined behavior";
+		case GL_DEBUG_TYPE_PORTABILITY:         return "portability";
+		case GL_DEBUG_TYPE_PERFORMANCE:         return "performance";
+		default:                                return "other";
+		}
+	}
+}
+
+
+void GlDebug::Install()
+{
+	// Both extensions share the enums and the callback signature
+	if (GLEW_KHR_debug && glDebugMessageCallback != nullptr && glDebugMessageControl != nullptr)
+		_useArb = false;
+	else if (GLEW_ARB_debug_output && glDebugMessageCallbackARB != nullptr && glDebugMessageControlARB != nullptr)
+		_useArb = true;
+	else
+		return;
+
+	if (_useArb)
+		glDebugMessageCallbackARB(Callback, nullptr);
+	else
+		glDebugMessageCallback(Callback, nullptr);
+
+	SetDefaultFilter();
+
+	// Debug output is on by default in debug contexts only; ARB_debug_output
+	// has no switch and works in debug contexts only.
+	if (!_useArb)
+		glEnable(GL_DEBUG_OUTPUT);
+
+#ifndef NDEBUG
+	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+#endif
+
+	while (glGetError() != GL_NO_ERROR) {}
+	_active = true;
+}
+
+bool GlDebug::IsActive() noexcept
+{
+	return _active;
+}
+
+unsigned GlDebug::GetNumErrors() noexcept
+{
+	return _numErrors.load(std::memory_order_relaxed);
+}
+
+unsigned GlDebug::GetNumPerfWarnings() noexcept
+{
+	return _numPerfWarnings.load(std::memory_order_relaxed);
+}
+
+void GlDebug::SetDefaultFilter()
+{
+	// Errors and performance warnings of any severity, anything else only
+	// if it is important. Notifications (e.g. "buffer uses video memory")
+	// are pure noise.
+	SetFilter(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, false);
+	SetFilter(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_HIGH, true);
+	SetFilter(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_MEDIUM, true);
+	SetFilter(GL_DONT_CARE, GL_DEBUG_TYPE_ERROR, GL_DONT_CARE, true);
+	SetFilter(GL_DONT_CARE, GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR, GL_DONT_CARE, true);
+	SetFilter(GL_DONT_CARE, GL_DEBUG_TYPE_PERFORMANCE, GL_DONT_CARE, true);
+	SetFilter(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, false);
+}
+
+void GlDebug::Mute()
+{
+	if (!_active)
+		return;
+
+	// A debug group saves the filter and restores it when popped. Its push
+	// message is a notification and filtered out.
+	if (!_useArb)
+		glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, "GlDebug::Mute");
+
+	SetFilter(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, false);
+}
+
+void GlDebug::Unmute()
+{
+	if (!_active)
+		return;
+
+	if (_useArb)
+		SetDefaultFilter();
+	else
+		glPopDebugGroup();
+}
+
+void GlDebug::SetFilter(GLenum source, GLenum type, GLenum severity, bool enable)
+{
+	if (_useArb)
+		glDebugMessageControlARB(source, type, severity, 0, nullptr, enable ? GL_TRUE : GL_FALSE);
+	else
+		glDebugMessageControl(source, type, severity, 0, nullptr, enable ? GL_TRUE : GL_FALSE);
+}
+
+void GLAPIENTRY GlDebug::Callback(GLenum source, GLenum type, GLuint id, GLenum, GLsizei, const GLchar* message, const void*)
+{
+	// May be called from a driver thread when the output is asynchronous
+	if (type == GL_DEBUG_TYPE_ERROR || type == GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR)
+		_numErrors.fetch_add(1, std::memory_order_relaxed);
+	else if (type == GL_DEBUG_TYPE_PERFORMANCE)
+		_numPerfWarnings.fetch_add(1, std::memory_order_relaxed);
+
+	if (_numPrinted.fetch_add(1, std::memory_order_relaxed) >= MaxPrinted)
+		return;
+
+	std::cerr << "OpenGL " << TypeName(type) << " (" << SourceName(source) << ", id " << id << "): " << message << std::endl;
+}
@@ -0,0 +1,339 @@
+#include "LowResLayer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "GlState.hpp"
+#include "Helper.hpp"
+#include "ProgramCache.hpp"
+
+
+namespace
+{
+	// One triangle covering the viewport; the part of the layer inside its
+	// border spans texScale of the texture coordinates
+	const char* VertexShaderSource =
+		"#version 330 core\n"
+		"uniform vec2 texScale;\n"
+		"out vec2 texCoord;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 pos = vec2((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1);\n"
+		"	texCoord = 0.5 + 0.5 * pos * texScale;\n"
+		"	gl_Position = vec4(pos, 0, 1);\n"
+		"}\n";
+
+	const char* CompositeShaderSource =
+		"#version 330 core\n"
+		"uniform sampler2D layer;\n"
+		"in vec2 texCoord;\n"
+		"out vec4 FragColor;\n"
+		"void main()\n"
+		"{\n"
+		"	FragColor = vec4(texture(layer, texCoord).rgb, 1.0);\n"
+		"}\n";
+
+	// One direction of a separable gaussian; there is no light beyond the
+	// border of the layer
+	const char* BlurShaderSource =
+		"#version 330 core\n"
+		"uniform sampler2D layer;\n"
+		"uniform ivec2 step;\n"
+		"uniform int radius;\n"
+		"uniform float weights[33];\n"
+		"out vec4 FragColor;\n"
+		"vec3 fetch(ivec2 p) {\n"
+		"	ivec2 size = textureSize(layer, 0);\n"
+		"	bool inside = all(greaterThanEqual(p, ivec2(0))) && all(lessThan(p, size));\n"
+		"	return inside ? texelFetch(layer, p, 0).rgb : vec3(0.0);\n"
+		"}\n"
+		"void main()\n"
+		"{\n"
+		"	ivec2 p = ivec2(gl_FragCoord.xy);\n"
+		"	vec3 sum = weights[0] * fetch(p);\n"
+		"	for (int i = 1; i <= radius; ++i)\n"
+		"		sum += weights[i] * (fetch(p - i * step) + fetch(p + i * step));\n"
+		"	FragColor = vec4(sum, 1.0);\n"
+		"}\n";
+}
+
+
+LowResLayer::LowResLayer(GLenum format)
+	: _format(format)
+	, _downscale(1)
+	, _fbo(0)
+	, _texture(0)
+	, _blurFbo(0)
+	, _blurTexture(0)
+	, _program(0)
+	, _blurProgram(0)
+	, _texScaleIdx(-1)
+	, _blurStepIdx(-1)
+	, _blurRadiusIdx(-1)
+	, _blurWeightsIdx(-1)
+	, _vao(0)
+	, _width(0)
+	, _height(0)
+	, _margin(0)
+	, _prevFbo(0)
+	, _prevViewport()
+{}
+
+LowResLayer::~LowResLayer()
+{
+	// GL objects are freed by Release() while the context is alive
+}
+
+void LowResLayer::SetDownscale(int downscale)
+{
+	_downscale = std::max(downscale, 1);
+}
+
+int LowResLayer::GetDownscale() const
+{
+	return _downscale;
+}
+
+bool LowResLayer::IsEnabled() const
+{
+	return _downscale > 1;
+}
+
+void LowResLayer::Begin(int margin)
+{
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &_prevFbo);
+	glGetIntegerv(GL_VIEWPORT, _prevViewport);
+
+	_margin = std::max(margin, 0);
+	Resize(
+		(_prevViewport[2] + _downscale - 1) / _downscale + 2 * _margin,
+		(_prevViewport[3] + _downscale - 1) / _downscale + 2 * _margin);
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo);
+	glViewport(0, 0, _width, _height);
+	const GLfloat black[4] = { 0, 0, 0, 0 };
+	glClearBufferfv(GL_COLOR, 0, black);
+	CHECK_GL_ERROR
+}
+
+float LowResLayer::GetScale() const
+{
+	return (_prevViewport[3] > 0) ? (float)(_height - 2 * _margin) / (float)_prevViewport[3] : 1.0f;
+}
+
+glm::mat4 LowResLayer::AdjustProjection(const glm::mat4& matProjection) const
+{
+	const glm::vec3 scale(
+		(float)(_width - 2 * _margin) / (float)_width,
+		(float)(_height - 2 * _margin) / (float)_height,
+		1.0f);
+	return glm::scale(glm::mat4(1.0f), scale) * matProjection;
+}
+
+void LowResLayer::Blur(float sigma)
+{
+	const int radius = std::min((int)std::ceil(3 * sigma), MaxBlurRadius);
+	if (radius < 1)
+		return;
+
+	if (_program == 0)
+		CreatePrograms();
+
+	if (_blurTexture == 0)
+	{
+		glGenTextures(1, &_blurTexture);
+		glBindTexture(GL_TEXTURE_2D, _blurTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, _format, _width, _height, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		_blurFbo = CreateTarget(_blurTexture);
+	}
+
+	GLfloat weights[MaxBlurRadius + 1] = {};
+	float sum = 0;
+	for (int i = 0; i <= radius; ++i)
+	{
+		weights[i] = std::exp(-0.5f * (float)(i * i) / (sigma * sigma));
+		sum += (i == 0) ? weights[i] : 2 * weights[i];
+	}
+
+	for (int i = 0; i <= radius; ++i)
+		weights[i] /= sum;
+
+	GlState::Disable(GL_BLEND);
+	GlState::UseProgram(_blurProgram);
+	glUniform1i(_blurRadiusIdx, radius);
+	glUniform1fv(_blurWeightsIdx, radius + 1, weights);
+	glActiveTexture(GL_TEXTURE0);
+
+	// Rows into the intermediate, columns back into the layer
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _blurFbo);
+	glBindTexture(GL_TEXTURE_2D, _texture);
+	glUniform2i(_blurStepIdx, 1, 0);
+	DrawQuad();
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo);
+	glBindTexture(GL_TEXTURE_2D, _blurTexture);
+	glUniform2i(_blurStepIdx, 0, 1);
+	DrawQuad();
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	CHECK_GL_ERROR
+}
+
+void LowResLayer::End()
+{
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)_prevFbo);
+	glViewport(_prevViewport[0], _prevViewport[1], _prevViewport[2], _prevViewport[3]);
+}
+
+void LowResLayer::Composite()
+{
+	if (_program == 0)
+		CreatePrograms();
+
+	GlState::Enable(GL_BLEND);
+	GlState::BlendFunc(GL_ONE, GL_ONE);
+	GlState::BlendEquation(GL_FUNC_ADD);
+	GlState::UseProgram(_program);
+	glUniform2f(_texScaleIdx,
+		(float)(_width - 2 * _margin) / (float)_width,
+		(float)(_height - 2 * _margin) / (float)_height);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, _texture);
+	DrawQuad();
+	glBindTexture(GL_TEXTURE_2D, 0);
+	CHECK_GL_ERROR
+}
+
+void LowResLayer::Release()
+{
+	for (GLuint* fbo : { &_fbo, &_blurFbo })
+	{
+		if (*fbo != 0)
+		{
+			glDeleteFramebuffers(1, fbo);
+			*fbo = 0;
+		}
+	}
+
+	for (GLuint* texture : { &_texture, &_blurTexture })
+	{
+		if (*texture != 0)
+		{
+			glDeleteTextures(1, texture);
+			*texture = 0;
+		}
+	}
+
+	if (_vao != 0)
+	{
+		glDeleteVertexArrays(1, &_vao);
+		_vao = 0;
+	}
+
+	for (GLuint* program : { &_program, &_blurProgram })
+	{
+		if (*program != 0)
+		{
+			GlState::ForgetProgram(*program);
+			glDeleteProgram(*program);
+			*program = 0;
+		}
+	}
+
+	_width = 0;
+	_height = 0;
+}
+
+void LowResLayer::Resize(int width, int height)
+{
+	if (_fbo != 0 && width == _width && height == _height)
+		return;
+
+	if (_texture == 0)
+	{
+		glGenTextures(1, &_texture);
+		glBindTexture(GL_TEXTURE_2D, _texture);
+
+		// Bilinear magnification; the clamp keeps the border from wrapping
+		// around to the opposite edge
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_2D, _texture);
+	}
+
+	glTexImage2D(GL_TEXTURE_2D, 0, _format, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+
+	if (_blurTexture != 0)
+	{
+		glBindTexture(GL_TEXTURE_2D, _blurTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, _format, width, height, 0, GL_RGBA, GL_FLOAT, nullptr);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	if (_fbo == 0)
+		_fbo = CreateTarget(_texture);
+
+	_width = width;
+	_height = height;
+}
+
+GLuint LowResLayer::CreateTarget(GLuint texture)
+{
+	GLint prevFbo = 0;
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prevFbo);
+
+	GLuint fbo = 0;
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	const GLenum status = glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)prevFbo);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		glDeleteFramebuffers(1, &fbo);
+		throw std::runtime_error("LowResLayer: could not create an offscreen framebuffer");
+	}
+
+	return fbo;
+}
+
+void LowResLayer::DrawQuad()
+{
+	if (_vao == 0)
+		glGenVertexArrays(1, &_vao);
+
+	glBindVertexArray(_vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+}
+
+void LowResLayer::CreatePrograms()
+{
+	_program = ProgramCache::Build(VertexShaderSource, CompositeShaderSource, "LowResLayer");
+	GlState::UseProgram(_program);
+	glUniform1i(glGetUniformLocation(_program, "layer"), 0);
+	_texScaleIdx = glGetUniformLocation(_program, "texScale");
+
+	_blurProgram = ProgramCache::Build(VertexShaderSource, BlurShaderSource, "LowResLayer");
+	GlState::UseProgram(_blurProgram);
+	glUniform1i(glGetUniformLocation(_blurProgram, "layer"), 0);
+	_blurStepIdx = glGetUniformLocation(_blurProgram, "step");
+	_blurRadiusIdx = glGetUniformLocation(_blurProgram, "radius");
+	_blurWeightsIdx = glGetUniformLocation(_blurProgram, "weights");
+}
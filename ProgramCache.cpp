@@ -0,0 +1,274 @@
+#include "ProgramCache.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#include "SDLWnd.hpp"
+
+
+namespace
+{
+	/// Increment when the file layout changes
+	const uint32_t FileVersion = 1;
+
+	const char FileMagic[4] = { 'G', 'R', 'P', 'B' };
+
+	struct FileHeader
+	{
+		char magic[4];
+		uint32_t version;
+		uint32_t format;      ///< binary format reported by the driver
+		uint32_t length;      ///< bytes of the binary following the header
+	};
+
+	/// 64 bit FNV-1a
+	uint64_t Hash(uint64_t hash, const std::string& data)
+	{
+		for (unsigned char c : data)
+		{
+			hash ^= c;
+			hash *= 0x100000001B3ull;
+		}
+
+		// separator, so "ab" + "c" and "a" + "bc" differ
+		hash ^= 0xFF;
+		hash *= 0x100000001B3ull;
+		return hash;
+	}
+
+	std::string GetString(GLenum name)
+	{
+		const GLubyte* str = glGetString(name);
+		return (str != nullptr) ? reinterpret_cast<const char*>(str) : "";
+	}
+}
+
+
+bool ProgramCache::IsSupported()
+{
+	static const bool supported = []()
+	{
+		if (glGetProgramBinary == nullptr || glProgramBinary == nullptr || glProgramParameteri == nullptr)
+			return false;
+
+		// Drivers may offer the functions but no binary format to use them with
+		GLint numFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+		while (glGetError() != GL_NO_ERROR) {}
+		return numFormats > 0 && !SDLWindow::GetUserDir().empty();
+	}();
+	return supported;
+}
+
+std::string ProgramCache::Key(const std::string& srcVertex, const std::string& srcFragment)
+{
+	if (!IsSupported())
+		return "";
+
+	static const std::string driver = GetString(GL_VENDOR) + "\n" + GetString(GL_RENDERER) + "\n" + GetString(GL_VERSION);
+
+	uint64_t hash = 0xCBF29CE484222325ull;
+	hash = Hash(hash, std::to_string(FileVersion));
+	hash = Hash(hash, driver);
+	hash = Hash(hash, srcVertex);
+	hash = Hash(hash, srcFragment);
+
+	char name[17];
+	std::snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+	return name;
+}
+
+std::string ProgramCache::GetPath(const std::string& key)
+{
+	return (std::filesystem::path(SDLWindow::GetUserDir()) / "shadercache" / (key + ".bin")).string();
+}
+
+GLuint ProgramCache::Load(const std::string& key)
+{
+	if (key.empty())
+		return 0;
+
+	const std::string path = GetPath(key);
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return 0;
+
+	FileHeader header = {};
+	std::vector<char> binary;
+	bool valid = file.read(reinterpret_cast<char*>(&header), sizeof(header))
+		&& std::equal(FileMagic, FileMagic + 4, header.magic)
+		&& header.version == FileVersion
+		&& header.length > 0;
+	if (valid)
+	{
+		binary.resize(header.length);
+		valid = (bool)file.read(binary.data(), binary.size());
+	}
+	file.close();
+
+	GLuint program = 0;
+	if (valid)
+	{
+		program = glCreateProgram();
+		glProgramBinary(program, header.format, binary.data(), (GLsizei)binary.size());
+
+		// A binary the driver does not take (e.g. after an update that kept
+		// the version string) fails like a link
+		GLint isLinked = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+		while (glGetError() != GL_NO_ERROR) {}
+		if (isLinked == GL_FALSE)
+		{
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+
+	if (program == 0)
+	{
+		std::error_code ec;
+		std::filesystem::remove(path, ec);
+	}
+
+	return program;
+}
+
+GLuint ProgramCache::Build(const std::string& srcVertex, const std::string& srcFragment, const char* owner)
+{
+	const std::string cacheKey = Key(srcVertex, srcFragment);
+	GLuint program = Load(cacheKey);
+	if (program != 0)
+		return program;
+
+	GLuint vertexShader = CompileShader(GL_VERTEX_SHADER, srcVertex, owner);
+	GLuint fragmentShader = 0;
+	try
+	{
+		fragmentShader = CompileShader(GL_FRAGMENT_SHADER, srcFragment, owner);
+	}
+	catch (...)
+	{
+		glDeleteShader(vertexShader);
+		throw;
+	}
+
+	program = glCreateProgram();
+	glAttachShader(program, vertexShader);
+	glAttachShader(program, fragmentShader);
+	PrepareLink(program);
+	glLinkProgram(program);
+
+	// Always detach shaders after linking, the program keeps the code
+	glDetachShader(program, vertexShader);
+	glDetachShader(program, fragmentShader);
+	glDeleteShader(vertexShader);
+	glDeleteShader(fragmentShader);
+
+	GLint isLinked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &isLinked);
+	if (isLinked == GL_FALSE)
+	{
+		GLint maxLength = 0;
+		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &maxLength);
+
+		// The maxLength includes the NULL character
+		std::vector<GLchar> infoLog(std::max(maxLength, 1));
+		glGetProgramInfoLog(program, (GLsizei)infoLog.size(), nullptr, infoLog.data());
+		glDeleteProgram(program);
+
+		throw std::runtime_error(std::string(owner) + ": shader program linking failed!\r\n" + infoLog.data());
+	}
+
+	Store(cacheKey, program);
+	return program;
+}
+
+void ProgramCache::PrepareLink(GLuint program)
+{
+	if (IsSupported())
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+GLuint ProgramCache::CompileShader(GLenum shaderType, const std::string& source, const char* owner)
+{
+	const char* src = source.c_str();
+	GLuint shader = glCreateShader(shaderType);
+	glShaderSource(shader, 1, &src, nullptr);
+	glCompileShader(shader);
+
+	GLint isCompiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
+	if (isCompiled == GL_FALSE)
+	{
+		GLint maxLength = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &maxLength);
+
+		// The maxLength includes the NULL character
+		std::vector<GLchar> infoLog(std::max(maxLength, 1));
+		glGetShaderInfoLog(shader, (GLsizei)infoLog.size(), nullptr, infoLog.data());
+		glDeleteShader(shader);
+
+		throw std::runtime_error(std::string(owner) + ": Shader compilation failed: " + infoLog.data());
+	}
+
+	return shader;
+}
+
+void ProgramCache::Store(const std::string& key, GLuint program)
+{
+	if (key.empty())
+		return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+
+	FileHeader header = {};
+	std::copy(FileMagic, FileMagic + 4, header.magic);
+	header.version = FileVersion;
+
+	std::vector<char> binary(length);
+	GLsizei written = 0;
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &written, &format, binary.data());
+	while (glGetError() != GL_NO_ERROR) {}
+	if (written <= 0)
+		return;
+
+	header.format = format;
+	header.length = (uint32_t)written;
+
+	// Write a temporary file and rename it, so a second instance never
+	// reads a partial file
+	namespace fs = std::filesystem;
+	const fs::path path = GetPath(key);
+	const fs::path tmpPath = fs::path(path).concat(".tmp");
+	std::error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return;
+
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(binary.data(), written);
+		if (!file.good())
+		{
+			file.close();
+			fs::remove(tmpPath, ec);
+			return;
+		}
+	}
+
+	fs::rename(tmpPath, path, ec);
+	if (ec)
+		fs::remove(tmpPath, ec);
+}
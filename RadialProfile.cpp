@@ -0,0 +1,162 @@
+#include "RadialProfile.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Helper.hpp"
+
+
+RadialProfile::RadialProfile()
+	: _param()
+	, _radMax(0)
+	, _mass0(0)
+	, _table()
+	, _version(0)
+{}
+
+void RadialProfile::Setup(const Param& param)
+{
+	const bool same = !_table.empty()
+		&& param.radCore == _param.radCore
+		&& param.radGalaxy == _param.radGalaxy
+		&& param.radFarField == _param.radFarField
+		&& param.exInner == _param.exInner
+		&& param.exOuter == _param.exOuter
+		&& param.angleOffset == _param.angleOffset
+		&& param.barRadius == _param.barRadius
+		&& param.barEx == _param.barEx
+		&& param.hasDarkMatter == _param.hasDarkMatter;
+	if (same)
+		return;
+
+	_param = param;
+
+	// Beyond the far field only the dust clouds in the corners of the
+	// square around the galaxy remain; they are evaluated analytically.
+	_radMax = 1.25f * param.radFarField;
+	_mass0 = (float)Helper::EnclosedMass(0, param.hasDarkMatter);
+
+	_table.resize((std::size_t)NumSamples * NumChannels);
+	for (int i = 0; i < NumSamples; ++i)
+	{
+		const float rad = i * _radMax / (NumSamples - 1);
+		for (int ch = 0; ch < NumChannels; ++ch)
+			_table[(std::size_t)i * NumChannels + ch] = Analytic(param, (Channel)ch, rad);
+	}
+
+	// The mass profile is a limit at r = 0; extrapolate it
+	_table[chMass] = 2 * _table[NumChannels + chMass] - _table[2 * NumChannels + chMass];
+
+	++_version;
+}
+
+const RadialProfile::Param& RadialProfile::GetParam() const noexcept
+{
+	return _param;
+}
+
+float RadialProfile::GetMaxRadius() const noexcept
+{
+	return _radMax;
+}
+
+const float* RadialProfile::GetTable() const noexcept
+{
+	return _table.data();
+}
+
+unsigned RadialProfile::GetVersion() const noexcept
+{
+	return _version;
+}
+
+void RadialProfile::Eval(Channel ch, const float* rad, float* out, std::size_t num) const
+{
+	// Linear interpolation; the loop is free of branches so the compiler can
+	// vectorize it. The shader interpolates the same way (profileAt()).
+	const float* table = _table.data() + ch;
+	const float scale = (NumSamples - 1) / _radMax;
+	for (std::size_t i = 0; i < num; ++i)
+	{
+		const float x = std::clamp(rad[i] * scale, 0.0f, (float)(NumSamples - 1));
+		const int idx = std::min((int)x, NumSamples - 2);
+		const float v0 = table[idx * NumChannels];
+		const float v1 = table[(idx + 1) * NumChannels];
+		out[i] = v0 + (x - (float)idx) * (v1 - v0);
+	}
+
+	for (std::size_t i = 0; i < num; ++i)
+	{
+		if (rad[i] < 0 || rad[i] > _radMax)
+			out[i] = Analytic(_param, ch, rad[i]);
+	}
+}
+
+void RadialProfile::EvalAngularVelocity(const float* rad, float* out, std::size_t num) const
+{
+	Eval(chMass, rad, out, num);
+
+	// v = 20000 * sqrt(G * M / r) km/s (Helper::VelocityFromMass) on a
+	// circumference of 2 * pi * r pc
+	const float degPerYear = 20000.0f * 360.0f * Helper::SEC_PER_YEAR / (2.0f * Helper::PI * Helper::PC_TO_KM);
+	for (std::size_t i = 0; i < num; ++i)
+	{
+		const float r = rad[i];
+		const float mass = _mass0 + r * r * out[i];
+		out[i] = degPerYear * std::sqrt(Helper::CONTANT_OF_GRAVITY * mass / r) / r;
+	}
+}
+
+float RadialProfile::Excentricity(const Param& param, float r)
+{
+	if (r < param.radCore)
+	{
+		if (param.barRadius > 0)
+		{
+			// Barred core: strongly elongated orbits out to the bar end,
+			// then blending back into the regular core value.
+			if (r < param.barRadius)
+				return 1 + (r / param.barRadius) * (param.barEx - 1);
+			return param.barEx + (r - param.barRadius) / (param.radCore - param.barRadius) * (param.exInner - param.barEx);
+		}
+
+		// Core region of the galaxy. Innermost part is round
+		// excentricity increasing linear to the border of the core.
+		return 1 + (r / param.radCore) * (param.exInner - 1);
+	}
+	else if (r <= param.radGalaxy)
+	{
+		return param.exInner + (r - param.radCore) / (param.radGalaxy - param.radCore) * (param.exOuter - param.exInner);
+	}
+	else if (r < param.radFarField)
+	{
+		// excentricity is slowly reduced to 1.
+		return param.exOuter + (r - param.radGalaxy) / (param.radFarField - param.radGalaxy) * (1 - param.exOuter);
+	}
+	else
+		return 1;
+}
+
+float RadialProfile::Tilt(const Param& param, float r)
+{
+	// Inside the bar all orbits share the orientation of the bar-end orbit,
+	// so the inner ellipses line up into a bar instead of twisting into a
+	// spiral. C0-continuous at the bar end where the arms peel off.
+	return std::max(r, param.barRadius) * param.angleOffset;
+}
+
+float RadialProfile::MassProfile(const Param& param, float r)
+{
+	const double mass0 = Helper::EnclosedMass(0, param.hasDarkMatter);
+	return (float)((Helper::EnclosedMass(r, param.hasDarkMatter) - mass0) / ((double)r * r));
+}
+
+float RadialProfile::Analytic(const Param& param, Channel ch, float rad)
+{
+	switch (ch)
+	{
+	case chExcentricity: return Excentricity(param, rad);
+	case chTilt:         return Tilt(param, rad);
+	default:             return MassProfile(param, rad);
+	}
+}
@@ -0,0 +1,292 @@
+#include "RingRenderer.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include "GlState.hpp"
+#include "Helper.hpp"
+#include "ProgramCache.hpp"
+
+
+namespace
+{
+	// Instance i is ring i, a triangle strip along its orbit ellipse between
+	// its inner and outer edge. Same orbit as calcPos of VertexBufferStars.
+	const std::string VertexShaderSource =
+		"#version 330 core\n"
+		"#define DEG_TO_RAD 0.01745329251\n"
+		"uniform mat4 projMat;\n"
+		"uniform sampler1D ringTable;\n"   // edge i: excentricity, tilt; ring i: velocity of stars, of dust
+		"uniform float time;\n"
+		"uniform float pertAmp;\n"
+		"uniform int pertN;\n"
+		"uniform int layer;\n"
+		"uniform float ringWidth;\n"
+		"out vec2 texelCoord;\n"           // (angle, radius) in texels of the layer
+		"flat out int ring;\n"
+		"void main()\n"
+		"{\n"
+		"	ring = gl_InstanceID;\n"
+		"	int edge = ring + (gl_VertexID & 1);\n"
+		"	float theta = float(gl_VertexID >> 1) * (360.0 / " + std::to_string(RingRenderer::NumSegments) + ".0);\n"
+		"	vec2 shape = texelFetch(ringTable, edge, 0).xy;\n"
+		"	vec2 vel = texelFetch(ringTable, ring, 0).zw;\n"
+		"	float a = float(edge) * ringWidth;\n"
+		"	float b = a * shape.x;\n"
+		"	float alpha = (theta + ((layer == 0) ? vel.x : vel.y) * time) * DEG_TO_RAD;\n"
+		"	float cosalpha = cos(alpha);\n"
+		"	float sinalpha = sin(alpha);\n"
+		"	float cosbeta = cos(shape.y);\n"
+		"	float sinbeta = -sin(shape.y);\n"
+		"	vec2 ps = vec2(a * cosalpha * cosbeta - b * sinalpha * sinbeta,\n"
+		"	               a * cosalpha * sinbeta + b * sinalpha * cosbeta);\n"
+		"	if (pertAmp > 0.0 && pertN > 0) {\n"
+		"		ps.x += (a / pertAmp) * sin(alpha * 2.0 * pertN);\n"
+		"		ps.y += (a / pertAmp) * cos(alpha * 2.0 * pertN);\n"
+		"	}\n"
+		"	texelCoord = vec2(theta * (" + std::to_string(RingRenderer::NumAngles) + ".0 / 360.0), float(edge));\n"
+		"	gl_Position = projMat * vec4(ps, 0, 1);\n"
+		"}\n";
+
+	// A texel holds the light of its particles; a pixel gets the share of
+	// the texels it covers. Texel k is centered on angle k (see the
+	// RING_SPLAT shader of VertexBufferStars).
+	const std::string FragmentShaderSource =
+		"#version 330 core\n"
+		"uniform sampler2D rings;\n"
+		"uniform float gain;\n"
+		"in vec2 texelCoord;\n"
+		"flat in int ring;\n"
+		"out vec4 FragColor;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 dx = dFdx(texelCoord);\n"
+		"	vec2 dy = dFdy(texelCoord);\n"
+		"	float texels = abs(dx.x * dy.y - dx.y * dy.x);\n"
+		"	vec2 size = vec2(textureSize(rings, 0));\n"
+		"	vec3 light = texture(rings, vec2((texelCoord.x + 0.5) / size.x, (float(ring) + 0.5) / size.y)).rgb;\n"
+		"	FragColor = vec4(light * texels * gain, 1.0);\n"
+		"}\n";
+}
+
+
+RingRenderer::RingRenderer()
+	: _fbo()
+	, _texture()
+	, _tableTexture(0)
+	, _program(0)
+	, _vao(0)
+	, _projMatIdx(-1)
+	, _timeIdx(-1)
+	, _pertNIdx(-1)
+	, _pertAmpIdx(-1)
+	, _layerIdx(-1)
+	, _ringWidthIdx(-1)
+	, _gainIdx(-1)
+	, _ringWidth(0)
+	, _profileVersion(0)
+	, _prevFbo(0)
+	, _prevViewport()
+{}
+
+RingRenderer::~RingRenderer()
+{
+	// GL objects are freed by Release() while the context is alive
+}
+
+bool RingRenderer::SetRadialProfile(const RadialProfile& profile)
+{
+	if (_tableTexture != 0 && profile.GetVersion() == _profileVersion)
+		return false;
+
+	const float ringWidth = profile.GetMaxRadius() / NumRings;
+
+	// The shape at the edges, so neighbouring rings meet; the velocities at
+	// the center. Dust clouds move with the velocity at their mean radius
+	// (see Galaxy::Derive).
+	std::vector<float> edge(NumRings + 1), center(NumRings + 1);
+	for (int i = 0; i <= NumRings; ++i)
+	{
+		edge[i] = i * ringWidth;
+		center[i] = (std::min(i, NumRings - 1) + 0.5f) * ringWidth;
+	}
+
+	std::vector<float> ex(NumRings + 1), tilt(NumRings + 1), exCenter(NumRings + 1), meanRadius(NumRings + 1);
+	std::vector<float> velStars(NumRings + 1), velDust(NumRings + 1);
+	profile.Eval(RadialProfile::chExcentricity, edge.data(), ex.data(), edge.size());
+	profile.Eval(RadialProfile::chTilt, edge.data(), tilt.data(), edge.size());
+	profile.Eval(RadialProfile::chExcentricity, center.data(), exCenter.data(), center.size());
+	for (int i = 0; i <= NumRings; ++i)
+		meanRadius[i] = center[i] * (1 + exCenter[i]) / 2;
+
+	profile.EvalAngularVelocity(center.data(), velStars.data(), center.size());
+	profile.EvalAngularVelocity(meanRadius.data(), velDust.data(), meanRadius.size());
+
+	std::vector<float> table(4 * (NumRings + 1));
+	for (int i = 0; i <= NumRings; ++i)
+	{
+		table[4 * i + 0] = ex[i];
+		table[4 * i + 1] = tilt[i];
+		table[4 * i + 2] = velStars[i];
+		table[4 * i + 3] = velDust[i];
+	}
+
+	if (_tableTexture == 0)
+	{
+		glGenTextures(1, &_tableTexture);
+		glBindTexture(GL_TEXTURE_1D, _tableTexture);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	}
+	else
+	{
+		glBindTexture(GL_TEXTURE_1D, _tableTexture);
+	}
+
+	glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, NumRings + 1, 0, GL_RGBA, GL_FLOAT, table.data());
+	glBindTexture(GL_TEXTURE_1D, 0);
+	CHECK_GL_ERROR
+
+	const bool resized = ringWidth != _ringWidth;
+	_ringWidth = ringWidth;
+	_profileVersion = profile.GetVersion();
+	return resized;
+}
+
+void RingRenderer::BeginSplat(Layer layer)
+{
+	glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &_prevFbo);
+	glGetIntegerv(GL_VIEWPORT, _prevViewport);
+
+	if (_fbo[layer] == 0)
+	{
+		glGenTextures(1, &_texture[layer]);
+		glBindTexture(GL_TEXTURE_2D, _texture[layer]);
+
+		// Linear along the rings, which wrap around; rings are sampled at
+		// their centers
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, NumAngles, NumRings, 0, GL_RGBA, GL_FLOAT, nullptr);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		glGenFramebuffers(1, &_fbo[layer]);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo[layer]);
+		glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _texture[layer], 0);
+		if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)_prevFbo);
+			Release();
+			throw std::runtime_error("RingRenderer: could not create the ring framebuffer");
+		}
+	}
+
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _fbo[layer]);
+	glViewport(0, 0, NumAngles, NumRings);
+	const GLfloat black[4] = { 0, 0, 0, 0 };
+	glClearBufferfv(GL_COLOR, 0, black);
+	CHECK_GL_ERROR
+}
+
+void RingRenderer::EndSplat()
+{
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)_prevFbo);
+	glViewport(_prevViewport[0], _prevViewport[1], _prevViewport[2], _prevViewport[3]);
+}
+
+void RingRenderer::Draw(Layer layer, const glm::mat4& matProjection, float time, int pertN, float pertAmp, float gain)
+{
+	if (_texture[layer] == 0 || _tableTexture == 0)
+		return;
+
+	if (_program == 0)
+		CreateProgram();
+
+	GlState::Enable(GL_BLEND);
+	GlState::BlendFunc(GL_ONE, GL_ONE);
+	GlState::BlendEquation(GL_FUNC_ADD);
+	GlState::UseProgram(_program);
+	glUniformMatrix4fv(_projMatIdx, 1, GL_FALSE, glm::value_ptr(matProjection));
+	glUniform1f(_timeIdx, time);
+	glUniform1i(_pertNIdx, pertN);
+	glUniform1f(_pertAmpIdx, pertAmp);
+	glUniform1i(_layerIdx, layer);
+	glUniform1f(_ringWidthIdx, _ringWidth);
+	glUniform1f(_gainIdx, gain);
+
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, _texture[layer]);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_1D, _tableTexture);
+	glActiveTexture(GL_TEXTURE0);
+
+	glBindVertexArray(_vao);
+	glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 2 * (NumSegments + 1), NumRings);
+	glBindVertexArray(0);
+	CHECK_GL_ERROR
+}
+
+void RingRenderer::Release()
+{
+	for (int layer = 0; layer < NumLayers; ++layer)
+	{
+		if (_fbo[layer] != 0)
+		{
+			glDeleteFramebuffers(1, &_fbo[layer]);
+			_fbo[layer] = 0;
+		}
+
+		if (_texture[layer] != 0)
+		{
+			glDeleteTextures(1, &_texture[layer]);
+			_texture[layer] = 0;
+		}
+	}
+
+	if (_tableTexture != 0)
+	{
+		glDeleteTextures(1, &_tableTexture);
+		_tableTexture = 0;
+	}
+
+	if (_vao != 0)
+	{
+		glDeleteVertexArrays(1, &_vao);
+		_vao = 0;
+	}
+
+	if (_program != 0)
+	{
+		GlState::ForgetProgram(_program);
+		glDeleteProgram(_program);
+		_program = 0;
+	}
+
+	_ringWidth = 0;
+}
+
+void RingRenderer::CreateProgram()
+{
+	_program = ProgramCache::Build(VertexShaderSource, FragmentShaderSource, "RingRenderer");
+
+	GlState::UseProgram(_program);
+	glUniform1i(glGetUniformLocation(_program, "rings"), 0);
+	glUniform1i(glGetUniformLocation(_program, "ringTable"), 1);
+	_projMatIdx = glGetUniformLocation(_program, "projMat");
+	_timeIdx = glGetUniformLocation(_program, "time");
+	_pertNIdx = glGetUniformLocation(_program, "pertN");
+	_pertAmpIdx = glGetUniformLocation(_program, "pertAmp");
+	_layerIdx = glGetUniformLocation(_program, "layer");
+	_ringWidthIdx = glGetUniformLocation(_program, "ringWidth");
+	_gainIdx = glGetUniformLocation(_program, "gain");
+
+	if (_vao == 0)
+		glGenVertexArrays(1, &_vao);
+}
@@ -17,6 +17,7 @@
 #include "imgui.h"
 #include "imgui_impl_sdl2.h"
 
+#include "GlDebug.hpp"
 #include "Helper.hpp"
 
 
@@ -108,6 +109,9 @@ void SDLWindow::Init(int width, int height, float axisLen, const std::string& ca
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
 //	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_COMPATIBILITY);
 	SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
+#ifndef NDEBUG
+	SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
+#endif
 
 	_pSdlWnd = SDL_CreateWindow(
 		caption.c_str(),
@@ -123,11 +127,13 @@ void SDLWindow::Init(int width, int height, float axisLen, const std::string& ca
 	_sdcGlContext = SDL_GL_CreateContext(_pSdlWnd);
 
 	glewInit();
+	GlDebug::Install();
 
 	std::cout << "OpenGL Version Information:" << glGetString(GL_VERSION) << std::endl;
 	std::cout << "- OpenGL:     " << glGetString(GL_VERSION) << std::endl;
 	std::cout << "- GLSL:       " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
 	std::cout << "- Vendor/GPU: " << glGetString(GL_VENDOR) << "/" << glGetString(GL_RENDERER) << std::endl;
+	std::cout << "- Debug output: " << (GlDebug::IsActive() ? "yes" : "no") << std::endl;
 
 	InitGL();
 	InitSimulation();
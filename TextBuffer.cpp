@@ -5,6 +5,8 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "Helper.hpp"
+#include "GlState.hpp"
+#include "ProgramCache.hpp"
 #include "SDLWnd.hpp"
 
 TextBuffer::TextBuffer()
@@ -14,6 +16,7 @@ TextBuffer::TextBuffer()
 	, _pFontCaption(nullptr)
 	, _updating(false)
 	, _shaderProgram(0)
+	, _projMatIdx(-1)
 {}
 
 TextBuffer::~TextBuffer()
@@ -49,34 +52,6 @@ const char* TextBuffer::GetFragmentShaderSource() const
 		"}\n";
 }
 
-GLuint TextBuffer::CreateShader(GLenum shaderType, const char** shaderSource)
-{
-	GLuint shader = glCreateShader(shaderType);
-	glShaderSource(shader, 1, shaderSource, nullptr);
-	glCompileShader(shader);
-
-	GLint isCompiled = 0;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
-	if (isCompiled == GL_FALSE)
-	{
-		GLint maxLength = 0;
-		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &maxLength);
-
-		// The maxLength includes the NULL character
-		std::vector<GLchar> infoLog(maxLength);
-		glGetShaderInfoLog(shader, maxLength, &maxLength, &infoLog[0]);
-
-		std::string msg(infoLog.data());
-
-		// We don't need the shader anymore.
-		glDeleteShader(shader);
-
-		throw std::runtime_error(std::string("VertecBuffer: Shader compilation failed: ") + msg);
-	}
-
-	return shader;
-}
-
 void TextBuffer::Initialize()
 {
 	if (!TTF_WasInit())
@@ -98,39 +73,8 @@ void TextBuffer::Initialize()
 	if (_pFontCaption == nullptr)
 		throw std::runtime_error(TTF_GetError());
 
-	const char* srcVertex = GetVertexShaderSource();
-	GLuint vertexShader = CreateShader(GL_VERTEX_SHADER, &srcVertex);
-
-	const char* srcFragment = GetFragmentShaderSource();
-	GLuint fragmentShader = CreateShader(GL_FRAGMENT_SHADER, &srcFragment);
-
-	_shaderProgram = glCreateProgram();
-	glAttachShader(_shaderProgram, vertexShader);
-	glAttachShader(_shaderProgram, fragmentShader);
-	glLinkProgram(_shaderProgram);
-
-	GLint isLinked = 0;
-	glGetProgramiv(_shaderProgram, GL_LINK_STATUS, (int*)&isLinked);
-	if (isLinked == GL_FALSE)
-	{
-		GLint maxLength = 0;
-		glGetProgramiv(_shaderProgram, GL_INFO_LOG_LENGTH, &maxLength);
-
-		// The maxLength includes the NULL character
-		std::vector<GLchar> infoLog(maxLength);
-		glGetProgramInfoLog(_shaderProgram, maxLength, &maxLength, &infoLog[0]);
-
-		// clean up
-		glDeleteProgram(_shaderProgram);
-		glDeleteShader(vertexShader);
-		glDeleteShader(fragmentShader);
-
-		throw std::runtime_error("VertexBuffer: shader program linking failed!");
-	}
-
-	// Always detach shaders after a successful link.
-	glDetachShader(_shaderProgram, vertexShader);
-	glDetachShader(_shaderProgram, fragmentShader);
+	_shaderProgram = ProgramCache::Build(GetVertexShaderSource(), GetFragmentShaderSource(), "TextBuffer");
+	_projMatIdx = glGetUniformLocation(_shaderProgram, "projMat");
 }
 
 float TextBuffer::GetFontSize(int idxFont) const
@@ -166,10 +110,14 @@ void TextBuffer::Draw(int width, int height, glm::mat4& matView, glm::mat4& matP
 {
 	CHECK_GL_ERROR
 		
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	GlState::Enable(GL_BLEND);
+	GlState::BlendFunc(GL_SRC_ALPHA, GL_ONE);
+	GlState::BlendEquation(GL_FUNC_ADD);
+	GlState::UseProgram(_shaderProgram);
 
-	glUseProgram(_shaderProgram);
+	// Note: You MUST use float parameters! (see https://stackoverflow.com/questions/12230312/is-glmortho-actually-wrong)
+	glm::mat4 projection = glm::ortho((float)0, (float)width, (float)height, (float)0, (float)0, (float)1);
+	glUniformMatrix4fv(_projMatIdx, 1, GL_FALSE, glm::value_ptr(projection));
 
 	GLuint vbo, ebo, vao;
 	glGenVertexArrays(1, &vao);
@@ -219,11 +167,6 @@ void TextBuffer::Draw(int width, int height, glm::mat4& matView, glm::mat4& matP
 
 		glBindTexture(GL_TEXTURE_2D, td.id);
 
-		GLuint projMatIdx = glGetUniformLocation(_shaderProgram, "projMat");
-		
-		// Note: You MUST use float parameters! (see https://stackoverflow.com/questions/12230312/is-glmortho-actually-wrong)
-		glm::mat4 projection = glm::ortho((float)0, (float)width, (float)height, (float)0, (float)0, (float)1);
-		glUniformMatrix4fv(projMatIdx, 1, GL_FALSE, glm::value_ptr(projection));
 		glBindVertexArray(vao);
 		glDrawElements(GL_TRIANGLES, sizeof(vertexData) / sizeof(VertexTexture), GL_UNSIGNED_INT, 0);
 
@@ -231,13 +174,9 @@ void TextBuffer::Draw(int width, int height, glm::mat4& matView, glm::mat4& matP
 		glDisableVertexAttribArray(attTexturePosition);
 	}
 
-	glUseProgram(0);
-
 	glDeleteVertexArrays(1, &vao);
 	glDeleteBuffers(1, &vbo);
 	glDeleteBuffers(1, &ebo);
-
-	glDisable(GL_BLEND);
 }
 
 void TextBuffer::BeginUpdate()
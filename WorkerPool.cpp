@@ -0,0 +1,124 @@
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+
+
+WorkerPool::WorkerPool(int numThreads)
+	: _threads()
+	, _task(nullptr)
+	, _numTasks(0)
+	, _nextTask(0)
+	, _busyWorkers(0)
+	, _jobId(0)
+	, _shutdown(false)
+	, _error()
+{
+	if (numThreads <= 0)
+		numThreads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+	// The calling thread of ParallelFor works too
+	for (int i = 1; i < numThreads; ++i)
+		_threads.emplace_back(&WorkerPool::WorkerMain, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_shutdown = true;
+	}
+	_cvWork.notify_all();
+
+	for (auto& thread : _threads)
+		thread.join();
+}
+
+int WorkerPool::GetNumThreads() const noexcept
+{
+	return (int)_threads.size() + 1;
+}
+
+void WorkerPool::ParallelFor(int numTasks, const std::function<void(int)>& task)
+{
+	if (numTasks <= 0)
+		return;
+
+	std::lock_guard<std::mutex> callLock(_callMutex);
+
+	// Not worth waking anybody up
+	if (numTasks == 1 || _threads.empty())
+	{
+		for (int i = 0; i < numTasks; ++i)
+			task(i);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_task = &task;
+		_numTasks = numTasks;
+		_nextTask = 0;
+		_busyWorkers = (int)_threads.size();
+		_error = nullptr;
+		++_jobId;
+	}
+	_cvWork.notify_all();
+
+	RunTasks();
+
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_cvDone.wait(lock, [this]() { return _busyWorkers == 0; });
+		_task = nullptr;
+		error = _error;
+		_error = nullptr;
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void WorkerPool::RunTasks()
+{
+	for (int i = _nextTask++; i < _numTasks; i = _nextTask++)
+	{
+		try
+		{
+			(*_task)(i);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_error)
+				_error = std::current_exception();
+
+			// Skip the remaining tasks
+			_nextTask = _numTasks;
+		}
+	}
+}
+
+void WorkerPool::WorkerMain()
+{
+	unsigned lastJob = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_cvWork.wait(lock, [this, lastJob]() { return _shutdown || _jobId != lastJob; });
+			if (_shutdown)
+				return;
+
+			lastJob = _jobId;
+		}
+
+		RunTasks();
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			--_busyWorkers;
+		}
+		_cvDone.notify_one();
+	}
+}
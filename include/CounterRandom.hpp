@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/** \brief Counter-based random numbers (Philox4x32-10).
+
+	A random number is a pure function of a key (seed, stream) and a counter
+	(index, draw). There is no generator state, so draw d of particle i can be
+	computed in O(1), in any order and on any thread, and the result is the
+	same on every platform and C library. The stream separates independent
+	sequences that share a seed (i.e. the particle classes of a galaxy).
+
+	Reference: Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3",
+	SC'11.
+*/
+class CounterRandom final
+{
+public:
+
+	/** \brief Sequential access to the draws of a single index.
+
+		Hands out draw 0, 1, 2, ... of one index. Philox produces four draws
+		per evaluation, the cursor evaluates it once per four draws.
+	*/
+	class Cursor final
+	{
+	public:
+		Cursor(const CounterRandom& rng, uint32_t index, uint32_t firstDraw = 0)
+			: _seed(rng._seed)
+			, _stream(rng._stream)
+			, _index(index)
+			, _draw(firstDraw)
+			, _block()
+		{
+			if ((_draw & 3) != 0)
+				CounterRandom(_seed, _stream).Block(_index, _draw >> 2, _block);
+		}
+
+		/// Next uniform random number in [0, 1)
+		float operator()()
+		{
+			if ((_draw & 3) == 0)
+				CounterRandom(_seed, _stream).Block(_index, _draw >> 2, _block);
+
+			return ToFloat(_block[_draw++ & 3]);
+		}
+
+	private:
+		// A copy of the key and not a reference to the generator: cursors are
+		// usually taken from a temporary.
+		uint32_t _seed;
+		uint32_t _stream;
+		uint32_t _index;
+		uint32_t _draw;
+		uint32_t _block[4];
+	};
+
+	CounterRandom(uint32_t seed, uint32_t stream)
+		: _seed(seed)
+		, _stream(stream)
+	{}
+
+	/// Uniform random number in [0, 1): draw "draw" of index "index".
+	float operator()(uint32_t index, uint32_t draw) const
+	{
+		uint32_t block[4];
+		Block(index, draw >> 2, block);
+		return ToFloat(block[draw & 3]);
+	}
+
+	Cursor At(uint32_t index, uint32_t firstDraw = 0) const
+	{
+		return Cursor(*this, index, firstDraw);
+	}
+
+	/// out[i] = (*this)(firstIndex + i, draw) for i in [0, count)
+	void Fill(uint32_t firstIndex, uint32_t count, uint32_t draw, float* out) const
+	{
+		const uint32_t word = draw & 3;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t block[4];
+			Block(firstIndex + i, draw >> 2, block);
+			out[i] = ToFloat(block[word]);
+		}
+	}
+
+	/// Draws 4 * block ... 4 * block + 3 of count consecutive indices as four
+	/// planes: out[d * count + i] = (*this)(firstIndex + i, 4 * block + d).
+	/// One Philox evaluation per index; the loop is branch free so the
+	/// compiler can vectorize it.
+	void FillBlock(uint32_t firstIndex, uint32_t count, uint32_t block, float* out) const
+	{
+		float* out0 = out;
+		float* out1 = out + count;
+		float* out2 = out + 2 * (std::size_t)count;
+		float* out3 = out + 3 * (std::size_t)count;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			uint32_t r[4];
+			Block(firstIndex + i, block, r);
+			out0[i] = ToFloat(r[0]);
+			out1[i] = ToFloat(r[1]);
+			out2[i] = ToFloat(r[2]);
+			out3[i] = ToFloat(r[3]);
+		}
+	}
+
+	/// The four raw 32 bit words of counter (index, block).
+	void Block(uint32_t index, uint32_t block, uint32_t out[4]) const
+	{
+		uint32_t c0 = index, c1 = block, c2 = _stream, c3 = 0;
+		uint32_t k0 = _seed, k1 = 0xC0FFEE11u ^ _stream;
+
+		for (int round = 0; round < 10; ++round)
+		{
+			const uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+			const uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+
+			const uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+			const uint32_t n1 = (uint32_t)p1;
+			const uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+			const uint32_t n3 = (uint32_t)p0;
+			c0 = n0; c1 = n1; c2 = n2; c3 = n3;
+
+			k0 += 0x9E3779B9u;
+			k1 += 0xBB67AE85u;
+		}
+
+		out[0] = c0;
+		out[1] = c1;
+		out[2] = c2;
+		out[3] = c3;
+	}
+
+	/// Maps a random 32 bit word to [0, 1); 24 bits are all a float holds.
+	static float ToFloat(uint32_t x)
+	{
+		return (float)(x >> 8) * (1.0f / 16777216.0f);
+	}
+
+private:
+	uint32_t _seed;
+	uint32_t _stream;
+};
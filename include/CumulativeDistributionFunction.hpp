@@ -1,6 +1,7 @@
 #pragma once
 
 
+#include <cstddef>
 #include <vector>
 
 
@@ -9,9 +10,16 @@ class CumulativeDistributionFunction final
 public:
 	CumulativeDistributionFunction();
 
-	double ProbFromVal(double fVal);
-	double ValFromProb(double fVal);
+	double ProbFromVal(double fVal) const;
+	double ValFromProb(double fVal) const;
 
+	/// Batch version of ValFromProb: val[i] = ValFromProb(prob[i]). Single
+	/// precision, no range checks (probabilities are clamped to [0, 1]) and
+	/// no branches, so the compiler can vectorize it.
+	void ValFromProb(const float* prob, float* val, std::size_t count) const;
+
+	/// Sets up the distribution. Recently built distributions are cached, so
+	/// setting up one with the same parameters again is cheap.
 	void SetupRealistic(double I0, double k, double a, double RBulge, double min, double max, int nSteps);
 
 private:
@@ -33,6 +41,10 @@ private:
 	std::vector<double> _vY2;
 	std::vector<double> _vX2;
 
+	/// _vY2 and _vM2 as interleaved (value, slope per table step) pairs for
+	/// the batch lookup
+	std::vector<float> _vInverse;
+
 	void BuildCDF(int nSteps);
 
 	double IntensityBulge(double R, double I0, double k);
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <vector>
 #include "Types.hpp"
+#include "CumulativeDistributionFunction.hpp"
+#include "RadialProfile.hpp"
+#include "WorkerPool.hpp"
 
 
 /** \brief A class to encapsulate the geometric details of a spiral galaxy. */
@@ -29,6 +35,23 @@ public:
 		bool hasBar = false;
 		float barRadius = 3000.0f;    ///< length of the bar semi-major axis (pc)
 		float barEx = 0.55f;          ///< axis ratio b/a of the bar orbits
+
+		/// Place stars and dust clouds with a low discrepancy sequence (see
+		/// QuasiRandom) instead of independent random numbers. Gives a
+		/// smooth disc with fewer particles.
+		bool quasiRandom = false;
+	};
+
+	/// Wall clock times of the last population build in milliseconds.
+	struct BuildStats
+	{
+		double msStars = 0;
+		double msDust = 0;
+		double msFilaments = 0;
+		double msH2 = 0;
+		double msDerive = 0;    ///< re-deriving particles after a parameter change
+		double msTotal = 0;
+		int numThreads = 0;     ///< number of threads the build ran on
 	};
 
 	Galaxy(
@@ -42,7 +65,93 @@ public:
 
 	void Reset(GalaxyParam param);
 
+	/// Everything the particle population depends on
+	struct Snapshot
+	{
+		GalaxyParam param;
+		float radFarField;
+		unsigned int seed;
+	};
+
+	Snapshot GetSnapshot() const;
+
+	/// Takes over the parameters of a snapshot. Only the parts of the
+	/// population that depend on changed parameters are updated.
+	void Apply(const Snapshot& snapshot);
+
+	/// Star fields that depend on the galaxy parameters (see Derive)
+	enum DerivedField : uint32_t
+	{
+		dfNone     = 0,
+		dfRadius   = 1 << 0,   ///< a; everything else depends on it
+		dfShape    = 1 << 1,   ///< b
+		dfTilt     = 1 << 2,   ///< tiltAngle
+		dfVelocity = 1 << 3,   ///< velTheta
+		dfTemp     = 1 << 4,   ///< temp of dust and filaments
+		dfAll      = dfRadius | dfShape | dfTilt | dfVelocity | dfTemp
+	};
+
+	/// A modification of the particle array: "removed" particles starting at
+	/// "first" were replaced by "inserted" new ones and the particles behind
+	/// them moved accordingly. Replaying the changes in order turns the array
+	/// as of the last ClearChanges() into the current one.
+	struct Change
+	{
+		std::size_t first;
+		std::size_t removed;
+		std::size_t inserted;
+		std::size_t dataFirst;   ///< current position of the inserted particles
+		std::size_t dataCount;   ///< number of particles at dataFirst to refresh
+		uint32_t fields;         ///< DerivedField bits to refresh; dfAll for new particles
+	};
+
+	/// Ranges of the particle classes in GetStars(); the classes follow
+	/// each other in this order. The particles of a class are independent
+	/// samples of the same distribution (no property depends on the position
+	/// in the array), so the first n of them are a representative subset of
+	/// the class. Drawing a prefix of each class is a level of detail that
+	/// needs no reordering or re-upload of the buffer.
+	struct Layout
+	{
+		std::size_t numStars = 0;
+		std::size_t numDust = 0;
+		std::size_t numFilaments = 0;  ///< number of filament particles
+		std::size_t numH2 = 0;         ///< number of H2 particles (two per region)
+	};
+
 	const std::vector<Star>& GetStars() const;
+	const Layout& GetLayout() const noexcept;
+	const BuildStats& GetBuildStats() const noexcept;
+
+	/// Changes of GetStars() since the last call to ClearChanges().
+	const std::vector<Change>& GetChanges() const noexcept;
+	void ClearChanges();
+
+	/// Appends a change to a list of changes and moves the data ranges of
+	/// the earlier ones accordingly.
+	static void AddChange(std::vector<Change>& changes, std::size_t first, std::size_t removed, std::size_t inserted, uint32_t fields = dfAll);
+
+	/// With deferred updates parameter changes only mark the population out
+	/// of date; Update() brings it up to date. Otherwise every change
+	/// updates the population right away (the default).
+	void SetDeferredUpdate(bool deferred);
+
+	/// Brings the population up to date with the parameters. Returns false
+	/// if the update was cancelled; the outstanding work is kept then.
+	bool Update();
+	bool IsUpToDate() const noexcept;
+
+	/// Updates return early once *cancel is set; nullptr = never.
+	void SetCancelFlag(const std::atomic<bool>* cancel);
+
+	/// Replaces the population by one built elsewhere (see GalaxyBuilder).
+	/// \param changes The changes turning the current population into stars
+	/// \param layout The class ranges of stars
+	void SetPopulation(std::vector<Star>&& stars, const std::vector<Change>& changes, const Layout& layout, const BuildStats& stats);
+
+	/// Number of threads used for building the population; 0 = one per
+	/// hardware thread. The result does not depend on it.
+	void SetNumThreads(int n);
 
 	float GetRad() const;
 	float GetCoreRad() const;
@@ -54,6 +163,10 @@ public:
 	float GetExInner() const;
 	float GetExOuter() const;
 	float GetDustRenderSize() const;
+
+	/// Excentricity, tilt and velocity profile of the current parameters
+	const RadialProfile& GetRadialProfile() const;
+
 	int GetPertN() const;
 	float GetPertAmp() const;
 	float GetBaseTemp() const noexcept;
@@ -63,6 +176,7 @@ public:
 	bool HasBar() const noexcept;
 	float GetBarRadius() const noexcept;
 	float GetBarEx() const noexcept;
+	bool IsQuasiRandom() const noexcept;
 
 	void SetPertN(int n);
 	void SetPertAmp(float amp);
@@ -79,6 +193,7 @@ public:
 	void SetBarEnabled(bool on);
 	void SetBarRadius(float rad);
 	void SetBarEx(float ex);
+	void SetQuasiRandom(bool on);
 
 	void ToggleDarkMatter();
 	bool HasDarkMatter() const noexcept;
@@ -88,7 +203,86 @@ private:
 	Galaxy(const Galaxy& obj);
 	Galaxy& operator=(const Galaxy& obj);
 
-	void InitStarsAndDust();
+	/// Independent random streams of the particle classes (see CounterRandom)
+	enum RandomStream : uint32_t
+	{
+		rsStars = 0,
+		rsDust,
+		rsFilaments,
+		rsH2,
+		rsCount
+	};
+
+	/// How a particle radius is made from its draw
+	enum RadiusMode : uint8_t
+	{
+		rmCdf = 0,      ///< sample is a probability of the radial distribution
+		rmScaled        ///< radius = sample * _radGalaxy + offset
+	};
+
+	/// The parameter independent part of a particle radius
+	struct RadiusDraw
+	{
+		float sample;
+		float offset;
+		RadiusMode mode;
+	};
+
+	/** \brief Radius draws of all particles as a structure of arrays parallel
+		to _stars.
+
+		The draws are all a particle needs besides the galaxy parameters to
+		derive its geometry. Parameter changes re-derive the affected fields
+		from them instead of generating the population again.
+	*/
+	struct RadiusDraws
+	{
+		std::vector<float> sample;
+		std::vector<float> offset;
+		std::vector<uint8_t> mode;
+
+		void Set(std::size_t idx, const RadiusDraw& draw);
+		void Push(const RadiusDraw& draw);
+		void Resize(std::size_t size);
+		void Insert(std::size_t pos, std::size_t num);
+		void Insert(std::size_t pos, const RadiusDraws& draws);
+		void Erase(std::size_t first, std::size_t last);
+		void Clear();
+	};
+
+	using Clock = std::chrono::steady_clock;
+	static double MsSince(Clock::time_point t);
+
+	void Invalidate(uint32_t fields);
+	bool IsCancelled() const noexcept;
+	WorkerPool& Workers() const;
+
+	RadialProfile::Param GetProfileParam() const;
+
+	bool InitStarsAndDust();
+	void SetupRadialDistribution();
+	bool UpdateDerived(uint32_t fields);
+	void Derive(Star* stars, const RadiusDraws& draws, std::size_t first, std::size_t last, uint32_t fields) const;
+	void ResizeStars();
+	void ResizeDust();
+	void ResizeH2();
+	void AddChange(std::size_t first, std::size_t removed, std::size_t inserted, uint32_t fields = dfAll);
+
+	std::size_t GetDustOffset() const noexcept;
+	std::size_t GetFilamentOffset() const noexcept;
+	std::size_t GetH2Offset() const noexcept;
+
+	void GenerateStars(int first, int last, std::size_t pos);
+	void GenerateDust(int first, int last, std::size_t pos);
+	void GenerateFilaments(int first, int last, std::vector<Star>& stars, RadiusDraws& draws);
+	void GenerateH2(int first, int last, std::size_t pos);
+	void InitStar(int idx, const float* draws, int stride, Star& star) const;
+	RadiusDraw InitDust(int idx, Star& dustParticle) const;
+	void AddFilament(int idx, std::vector<Star>& filament, RadiusDraws& draws) const;
+	RadiusDraw InitH2(int idx, Star& particleH2) const;
+
+	/// Number of particles handed to a worker thread at once.
+	static constexpr int ChunkSize = 4096;
 
 	float _elEx1;          ///< Excentricity of the innermost ellipse
 	float _elEx2;          ///< Excentricity of the outermost ellipse
@@ -116,6 +310,30 @@ private:
 	float _barRadius;
 	float _barEx;
 
+	bool _quasiRandom;
+
 private:
 	std::vector<Star> _stars;  ///< Pointer to an array of star and dust data
+	Layout _layout;            ///< Class ranges of _stars
+	RadiusDraws _radius;       ///< Radius draws of the particles in _stars
+
+	CumulativeDistributionFunction _cdf;  ///< Radial distribution of stars and dust
+	mutable RadialProfile _profile;       ///< see GetRadialProfile()
+	int _numThreads;
+	mutable std::unique_ptr<WorkerPool> _workers;  ///< created on first use
+	BuildStats _buildStats;
+
+	// Population state: the particle counts it was built for and the work
+	// outstanding to bring it up to date with the parameters
+	int _builtStars;
+	int _builtDust;
+	int _builtH2;
+	bool _rebuildPending;       ///< a new population must be generated
+	uint32_t _pending;          ///< DerivedField bits to update
+	bool _deferred;             ///< see SetDeferredUpdate()
+	const std::atomic<bool>* _cancel;
+
+	std::vector<std::size_t> _filamentOffsets;  ///< end of filament i is at _filamentOffsets[i + 1]
+	std::vector<Change> _changes;
+	std::size_t _ackedSize;     ///< number of particles at the last ClearChanges()
 };
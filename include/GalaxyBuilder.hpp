@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Galaxy.hpp"
+
+
+/** \brief Builds the particle population of a galaxy on a background thread.
+
+	The builder keeps a galaxy of its own and brings it up to date with the
+	parameters submitted from the UI thread. Finished populations are
+	published as a copy together with the changes that lead to them, so the
+	UI keeps drawing the previous population until the next one is fetched.
+	Submitting new parameters cancels a build for older ones unless the last
+	published population is older than MaxStaleMs; then the running build is
+	finished first so that a long drag still updates the display.
+*/
+class GalaxyBuilder final
+{
+public:
+	GalaxyBuilder();
+	~GalaxyBuilder();
+
+	/// Number of threads the population is built with; 0 = one per hardware
+	/// thread.
+	void SetNumThreads(int n);
+
+	/// Requests the population for the current parameters of galaxy.
+	/// \param detail Fraction of the stars and dust clouds to build. Particle
+	///        i does not depend on the particle count, so a partial population
+	///        is a representative sample of the full one and building the full
+	///        one later only adds the missing particles.
+	void Submit(const Galaxy& galaxy, float detail = 1);
+
+	/// Installs the newest finished population into galaxy. Returns false if
+	/// there is none since the last call.
+	/// \param detail Receives the detail the population was built with
+	bool Fetch(Galaxy& galaxy, float& detail);
+
+	/// True while the population of the last submitted parameters is not
+	/// finished.
+	bool IsBusy() const;
+
+private:
+
+	GalaxyBuilder(const GalaxyBuilder& obj);
+	GalaxyBuilder& operator=(const GalaxyBuilder& obj);
+
+	void BuilderMain();
+
+	using Clock = std::chrono::steady_clock;
+	static constexpr int MaxStaleMs = 100;
+
+	Galaxy _work;                   ///< only used by the builder thread
+	std::atomic<bool> _cancel;      ///< set when _request is superseded
+
+	mutable std::mutex _mutex;      ///< guards everything below
+	std::condition_variable _cv;
+	bool _shutdown;
+
+	Galaxy::Snapshot _request;
+	float _requestDetail;
+	unsigned _requestId;            ///< incremented for every Submit()
+	int _numThreads;
+
+	std::vector<Star> _result;
+	std::vector<Galaxy::Change> _resultChanges;  ///< since the last Fetch()
+	Galaxy::Layout _resultLayout;
+	Galaxy::BuildStats _resultStats;
+	float _resultDetail;
+	unsigned _resultId;             ///< request the result was built for
+	bool _hasResult;
+	Clock::time_point _resultTime;  ///< when the last result was published
+
+	std::thread _thread;            ///< last member: starts in the constructor
+};
@@ -1,17 +1,22 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include <string>
 #include <SDL_ttf.h>
 
 #include "SDLWnd.hpp"
 #include "Galaxy.hpp"
+#include "GalaxyBuilder.hpp"
 #include "VertexBufferBase.hpp"
 #include "VertexBufferLines.hpp"
 #include "VertexBufferStars.hpp"
+#include "LowResLayer.hpp"
+#include "RingRenderer.hpp"
 #include "TextBuffer.hpp"
 #include "VideoRecorder.hpp"
+#include "WorkerPool.hpp"
 
 
 /** \brief Main window of th n-body simulation. */
@@ -23,6 +28,7 @@ public:
 	~GalaxyWnd();
 
 	void SetVideoOptions(int width, int height, int fps);
+	void SetNumThreads(int n);
 
 protected:
 	virtual void Render() override;
@@ -61,6 +67,8 @@ private:
 	float _time;
 	uint32_t _flags;	///< The display flags
 	Galaxy _galaxy;
+	GalaxyBuilder _builder;
+	std::unique_ptr<WorkerPool> _uploadWorkers;  ///< writes the star vertices (see UpdateStars)
 
 	uint32_t _renderUpdateHint;
 
@@ -77,6 +85,16 @@ private:
 	int _videoHeight;
 	int _videoFps;
 
+	/// Offscreen layers of one framebuffer (see RenderScene)
+	struct SceneLayers
+	{
+		LowResLayer reduced;                      ///< dust and filaments at reduced resolution
+		LowResLayer dustGrid{ GL_RGBA32F };       ///< binned dust (see _dustGrid)
+	};
+
+	SceneLayers _layersWnd;
+	SceneLayers _layersVideo;
+
 	/// A galaxy configuration loaded from a text file in the "presets" folder.
 	/// Values a file does not mention keep their current setting when applied.
 	struct GalaxyPreset
@@ -99,6 +117,12 @@ private:
 	bool SavePreset(const std::string& name);
 
 	static const float TimeStepSize;
+	static const float PreviewBudgetMs;   ///< build time aimed at for a preview population
+	static const float MinPreviewDetail;  ///< lower limit of _previewDetail
+	static const float MinLevelOfDetail;  ///< lower limit of _lod
+	static const std::size_t UploadChunkSize;  ///< vertices per upload task
+	static const float DustGridMag;       ///< magnitude of a dust cloud representative for the blur
+	static const float DustGridSigma;     ///< blur radius aimed at, in grid cells
 
 	GalaxyWnd(const GalaxyWnd& orig);
 
@@ -115,9 +139,13 @@ private:
 	void UpdateDensityWaves();
 	void UpdateAxis();
 	void UpdateStars();
+	static uint32_t StreamsOfFields(uint32_t fields);
+	void UpdateDrawOrder();
 	void UpdateVelocityCurve();
+	void UpdateDrawRanges(float lod);
+	void AdaptLevelOfDetail(float frameMs);
 
-	void RenderScene(glm::mat4& matView, glm::mat4& matProjection, bool overlays);
+	void RenderScene(glm::mat4& matView, glm::mat4& matProjection, bool overlays, SceneLayers& layers);
 	void RenderUI();
 	void ToggleVideoRecording();
 
@@ -131,10 +159,34 @@ private:
 	int _targetFps = 60;            ///< Target framerate when limiting is on
 	uint32_t _lastFrameTicks = 0;   ///< SDL_GetTicks() at the previous frame
 
-	// Cache for parameters whose edit triggers an expensive star/dust rebuild.
-	// Widgets bind to these; the model is only updated when a widget is
-	// released (see RenderUI). Kept in sync with the model while no widget is
-	// being dragged, so keyboard shortcuts stay reflected in the panel.
+	// Interactive preview: while a widget is dragged the builder only builds
+	// a fraction of the stars and dust clouds (see Update)
+	float _previewDetail = 0.25f;   ///< fraction built while dragging; adapts to PreviewBudgetMs
+	float _submittedDetail = 1.0f;  ///< fraction of the last submitted build
+	float _populationGain = 1.0f;   ///< brightness gain of the displayed population
+
+	// Level of detail: only a fraction of the stars, dust and filament
+	// particles is drawn (see UpdateDrawRanges)
+	float _lod = 1.0f;              ///< fraction of each particle class drawn in the window
+	bool _autoLod = false;          ///< adapt _lod to the target framerate
+	float _frameMs = 0.0f;          ///< smoothed frame time
+
+	// Dust as a density field: each cloud adds its light to a coarse grid
+	// that is blurred instead of drawing its sprite (see RenderScene)
+	bool _dustGrid = false;
+
+	// Ring engine: stars, dust and filaments as rotating rings (see
+	// RingRenderer), splatted again when the population changed
+	RingRenderer _rings;
+	bool _ringEngine = false;
+	bool _ringsDirty = true;
+	int _ringFeatures = 0;          ///< particle classes in the ring textures
+
+	// Cache for parameters whose edit triggers a population rebuild. Widgets
+	// bind to these; edits are applied live while dragging and rendered as a
+	// low detail preview (see Update). Kept in sync with the model while no
+	// widget is being dragged, so keyboard shortcuts stay reflected in the
+	// panel.
 	struct UiCache
 	{
 		int   radCore = 0;
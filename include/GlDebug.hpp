@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+
+#include <GL/glew.h>
+
+
+/** \brief Error reporting through the debug output of the driver.
+
+	Polling glGetError after every call (CHECK_GL_ERROR) may stall the CPU
+	until the GPU caught up, so release builds compile these checks out.
+	Instead the driver reports errors and performance warnings through a
+	callback (GL_KHR_debug or GL_ARB_debug_output) and this class counts
+	them. Debug builds request a debug context and keep CHECK_GL_ERROR; the
+	callback then runs synchronously in the failing call, which gives
+	debuggers a usable stack.
+*/
+class GlDebug final
+{
+public:
+
+	/// Installs the callback if the driver supports debug output. Needs a
+	/// current OpenGL context.
+	static void Install();
+
+	/// Whether Install found debug output support
+	static bool IsActive() noexcept;
+
+	/// Number of errors (including undefined behavior) the driver reported
+	static unsigned GetNumErrors() noexcept;
+
+	/// Number of performance warnings the driver reported
+	static unsigned GetNumPerfWarnings() noexcept;
+
+	/// Enables or disables the messages of a source, type and severity;
+	/// GL_DONT_CARE matches all. Messages of low importance are disabled
+	/// by Install.
+	static void SetFilter(GLenum source, GLenum type, GLenum severity, bool enable);
+
+	/// Suppresses all messages until Unmute(), e.g. around a call that is
+	/// expected to fail on some drivers. Unmute() restores the filter of
+	/// Install (GL_ARB_debug_output has no debug groups to restore others).
+	static void Mute();
+	static void Unmute();
+
+private:
+
+	static void SetDefaultFilter();
+
+	static void GLAPIENTRY Callback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam);
+
+	/// Messages printed at most, so a message repeated every frame does not
+	/// flood the console
+	static constexpr unsigned MaxPrinted = 50;
+
+	static inline bool _active = false;
+	static inline bool _useArb = false;   ///< GL_ARB_debug_output instead of GL_KHR_debug
+	static inline std::atomic<unsigned> _numErrors{ 0 };
+	static inline std::atomic<unsigned> _numPerfWarnings{ 0 };
+	static inline std::atomic<unsigned> _numPrinted{ 0 };
+};
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+
+#include <GL/glew.h>
+
+
+/** \brief Shadow copy of the OpenGL state the renderers of this program set.
+
+	Every draw call sets the capabilities, the blend mode and the program it
+	needs through this class; calls that would not change the state of the
+	context are filtered out. The renderers do not restore the state after
+	drawing, the next one sets what it needs anyway.
+
+	State changed behind the back of this class (e.g. by Dear ImGui) is
+	unknown to it: call Invalidate() afterwards. All functions must be
+	called on the thread owning the OpenGL context.
+*/
+class GlState final
+{
+public:
+
+	/// glEnable(cap)
+	static void Enable(GLenum cap)
+	{
+		Set(cap, true);
+	}
+
+	/// glDisable(cap)
+	static void Disable(GLenum cap)
+	{
+		Set(cap, false);
+	}
+
+	/// glEnable(cap) or glDisable(cap). Capabilities this class does not
+	/// track are passed on unfiltered.
+	static void Set(GLenum cap, bool enable)
+	{
+		const int idx = CapIndex(cap);
+		const State state = enable ? stOn : stOff;
+		if (idx >= 0 && _cap[idx] == state)
+			return;
+
+		if (enable)
+			glEnable(cap);
+		else
+			glDisable(cap);
+
+		if (idx >= 0)
+			_cap[idx] = state;
+	}
+
+	static void BlendFunc(GLenum src, GLenum dst)
+	{
+		if (_blendFuncKnown && _blendSrc == src && _blendDst == dst)
+			return;
+
+		glBlendFunc(src, dst);
+		_blendSrc = src;
+		_blendDst = dst;
+		_blendFuncKnown = true;
+	}
+
+	static void BlendEquation(GLenum mode)
+	{
+		if (_blendEquation == mode)
+			return;
+
+		glBlendEquation(mode);
+		_blendEquation = mode;
+	}
+
+	static void UseProgram(GLuint program)
+	{
+		if (_program == program)
+			return;
+
+		glUseProgram(program);
+		_program = program;
+	}
+
+	/// A program is deleted; the name may be reused by the next one created
+	static void ForgetProgram(GLuint program)
+	{
+		if (_program == program)
+			_program = Unknown;
+	}
+
+	/// Forgets everything; the next call of each function goes to OpenGL
+	static void Invalidate()
+	{
+		for (auto& cap : _cap)
+			cap = stUnknown;
+
+		_blendFuncKnown = false;
+		_blendEquation = Unknown;
+		_program = Unknown;
+	}
+
+private:
+
+	enum State : unsigned char
+	{
+		stUnknown = 0,
+		stOff,
+		stOn
+	};
+
+	/// Not a valid value of any of the tracked enums or program names
+	static constexpr GLuint Unknown = 0xFFFFFFFF;
+
+	/// The tracked capabilities
+	static int CapIndex(GLenum cap)
+	{
+		switch (cap)
+		{
+		case GL_BLEND:              return 0;
+		case GL_PROGRAM_POINT_SIZE: return 1;
+		case GL_PRIMITIVE_RESTART:  return 2;
+		case GL_POINT_SPRITE:       return 3;
+		case GL_DEPTH_TEST:         return 4;
+		default:                    return -1;
+		}
+	}
+
+	static constexpr std::size_t NumCaps = 5;
+
+	static inline State _cap[NumCaps] = {};
+	static inline bool _blendFuncKnown = false;   ///< _blendSrc and _blendDst are known
+	static inline GLenum _blendSrc = 0;
+	static inline GLenum _blendDst = 0;
+	static inline GLenum _blendEquation = Unknown;
+	static inline GLuint _program = Unknown;
+};
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <algorithm>
+#include <array>
 #include <string>
 #include <sstream>
 #include <GL/glew.h>
@@ -12,7 +15,13 @@
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define AT __FILE__ ":" TOSTRING(__LINE__)
+#ifdef NDEBUG
+// Release builds do not poll glGetError, the driver reports errors through
+// its debug output instead (see GlDebug).
+#define CHECK_GL_ERROR
+#else
 #define CHECK_GL_ERROR Helper::CheckGlError( " OpenGL error detected at " AT "!");
+#endif
 
 
 
@@ -50,11 +59,6 @@ public:
 		return power << 1; // power * 2;
 	}
 
-	static inline float rnum()
-	{
-		return (float)std::rand() / RAND_MAX;
-	}
-
 	static void CheckGlError(const char* szMsg)
 	{
 		auto errc = glGetError();
@@ -66,13 +70,18 @@ public:
 		}
 	}
 
-	static inline Color ColorFromTemperature(float temp)
-	{
-		const double MinTemp = 1000;
-		const double MaxTemp = 10000;
-		const int colNum(200);
+	/// Temperature range of the black body colors
+	static constexpr float ColorTableMinTemp = 1000;
+	static constexpr float ColorTableMaxTemp = 10000;
+
+	/// Number of entries of BlackBodySamples()
+	static constexpr int NumBlackBodySamples = 200;
 
-		const Color col[200] = {
+	/// Black body colors from ColorTableMinTemp to ColorTableMaxTemp in
+	/// NumBlackBodySamples equal steps
+	static inline const Color* BlackBodySamples()
+	{
+		static const Color col[NumBlackBodySamples] = {
 			{ 1, -0.00987248, -0.0166818, 1},
 			{ 1, 0.000671682, -0.0173831, 1 },
 			{ 1, 0.0113477, -0.0179839, 1 },
@@ -275,24 +284,88 @@ public:
 			{ 0.60472, 0.694643, 1, 1 }
 		};
 
-		int idx = (int)((temp - MinTemp) / (MaxTemp - MinTemp) * colNum);
-		idx = std::min(colNum - 1, idx);
-		idx = std::max(0, idx);
-		return col[idx];
+		return col;
+	}
+
+	/// Number of entries of the color table (see ColorTable). The index of
+	/// an entry fits into a byte.
+	static constexpr int ColorTableSize = 256;
+
+	/// Black body colors from ColorTableMinTemp to ColorTableMaxTemp in
+	/// ColorTableSize equal steps; entry i is the color at the center of
+	/// step i. Interpolated once from BlackBodySamples().
+	static inline const Color* ColorTable()
+	{
+		static const std::array<Color, ColorTableSize> table = []()
+		{
+			const Color* samples = BlackBodySamples();
+			std::array<Color, ColorTableSize> col;
+			for (int i = 0; i < ColorTableSize; ++i)
+			{
+				const float x = std::clamp((i + 0.5f) * NumBlackBodySamples / ColorTableSize - 0.5f, 0.0f, (float)(NumBlackBodySamples - 1));
+				const int idx = std::min((int)x, NumBlackBodySamples - 2);
+				const float f = x - (float)idx;
+				const Color& c0 = samples[idx];
+				const Color& c1 = samples[idx + 1];
+				col[i] = {
+					c0.r + f * (c1.r - c0.r),
+					c0.g + f * (c1.g - c0.g),
+					c0.b + f * (c1.b - c0.b),
+					c0.a + f * (c1.a - c0.a) };
+			}
+			return col;
+		}();
+
+		return table.data();
+	}
+
+	/// Index of the color of temperature temp in ColorTable()
+	static inline int ColorIndexFromTemperature(float temp)
+	{
+		const float scale = ColorTableSize / (ColorTableMaxTemp - ColorTableMinTemp);
+		return (int)std::clamp((temp - ColorTableMinTemp) * scale, 0.0f, (float)(ColorTableSize - 1));
+	}
+
+	/// ColorIndexFromTemperature of num temperatures. The loop is free of
+	/// branches so the compiler can vectorize it.
+	static inline void ColorIndicesFromTemperatures(const float* temp, uint8_t* idx, std::size_t num)
+	{
+		static_assert(ColorTableSize <= 256, "color indices are bytes");
+
+		const float scale = ColorTableSize / (ColorTableMaxTemp - ColorTableMinTemp);
+		for (std::size_t i = 0; i < num; ++i)
+			idx[i] = (uint8_t)std::clamp((temp[i] - ColorTableMinTemp) * scale, 0.0f, (float)(ColorTableSize - 1));
+	}
+
+	static inline Color ColorFromTemperature(float temp)
+	{
+		return ColorTable()[ColorIndexFromTemperature(temp)];
 	}
 
 	// Velocity curve with dark matter
 	static float VelocityWithDarkMatter(float r)
 	{
-		float MZ = 100;
-		return 20000.0f * (float)std::sqrt(Helper::CONTANT_OF_GRAVITY * (MassHalo(r) + MassDisc(r) + MZ) / r);
+		return VelocityFromMass(r, EnclosedMass(r, true));
 	}
 
 	// velocity curve without dark matter
 	static float VelocityWithoutDarkMatter(float r)
+	{
+		return VelocityFromMass(r, EnclosedMass(r, false));
+	}
+
+	// Mass inside radius r: central mass, disc and optionally the dark matter
+	// halo. Unlike the velocity it is smooth and finite at r = 0.
+	static double EnclosedMass(float r, bool withDarkMatter)
 	{
 		float MZ = 100;
-		return 20000.0f * (float)std::sqrt(Helper::CONTANT_OF_GRAVITY * (MassDisc(r) + MZ) / r);
+		return (withDarkMatter ? MassHalo(r) : 0.0f) + MassDisc(r) + MZ;
+	}
+
+	// Orbital velocity at radius r around the mass inside r
+	static float VelocityFromMass(float r, double mass)
+	{
+		return 20000.0f * (float)std::sqrt(Helper::CONTANT_OF_GRAVITY * mass / r);
 	}
 
 private:
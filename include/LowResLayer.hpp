@@ -0,0 +1,91 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+
+/** \brief Offscreen target at a fraction of the resolution of the framebuffer
+	it is added to.
+
+	The large, faint sprites of the dust clouds and filaments cover most of
+	the screen many times over; with additive blending their fill rate
+	dominates the frame time, in particular in 4K or 8K videos. Their light
+	is smooth by design, so drawing them at half or quarter resolution and
+	adding the magnified result to the stars looks almost the same at a
+	quarter or a sixteenth of the fill rate.
+
+	By default the layer is a half float texture: sums of many faint sprites neither
+	band nor clip before they are added to the framebuffer. Compositing adds
+	the layer (blend function GL_ONE, GL_ONE), so it matches additive
+	drawing straight into the framebuffer.
+
+	A layer may also hold a blurred density field (see Blur). Its border
+	is then extended beyond the viewport by a guard band so that light from
+	just outside still blurs into view.
+*/
+class LowResLayer final
+{
+public:
+	/// \param format internal format of the layer texture; must be color
+	///        renderable and blendable
+	explicit LowResLayer(GLenum format = GL_RGBA16F);
+	~LowResLayer();
+
+	/// Resolution divisor; 1 turns the layer off (see IsEnabled)
+	void SetDownscale(int downscale);
+	int GetDownscale() const;
+	bool IsEnabled() const;
+
+	/// Redirects rendering into the layer and clears it. The layer covers
+	/// the current viewport plus a border of margin layer pixels on each
+	/// side; the framebuffer and viewport are restored by End().
+	void Begin(int margin = 0);
+
+	/// Pixel size of the layer relative to the viewport of Begin(). Point
+	/// sizes are scaled by it to cover the same area.
+	float GetScale() const;
+
+	/// The projection to draw into the layer with; shrinks the view to
+	/// leave room for the border of Begin()
+	glm::mat4 AdjustProjection(const glm::mat4& matProjection) const;
+
+	/// Gaussian blur of the layer content with a standard deviation of sigma
+	/// layer pixels. Call between Begin() and End().
+	void Blur(float sigma);
+
+	void End();
+
+	/// Adds the layer magnified to the viewport of Begin()
+	void Composite();
+
+	void Release();
+
+private:
+	void Resize(int width, int height);
+	void CreatePrograms();
+	static GLuint CreateTarget(GLuint texture);
+	void DrawQuad();
+
+	/// Largest blur radius in pixels (three standard deviations); the blur
+	/// shader has a weight for each pixel up to it
+	static constexpr int MaxBlurRadius = 32;
+
+	GLenum _format;
+	int _downscale;
+	GLuint _fbo;
+	GLuint _texture;       ///< color attachment of _fbo
+	GLuint _blurFbo;       ///< intermediate of Blur; created on first use
+	GLuint _blurTexture;
+	GLuint _program;       ///< draws _texture over the viewport
+	GLuint _blurProgram;
+	GLint _texScaleIdx;    ///< uniform locations
+	GLint _blurStepIdx;
+	GLint _blurRadiusIdx;
+	GLint _blurWeightsIdx;
+	GLuint _vao;           ///< empty; core profiles draw nothing without one
+	int _width;            ///< size of _texture
+	int _height;
+	int _margin;           ///< border of Begin() in pixels of _texture
+	GLint _prevFbo;        ///< draw framebuffer bound at Begin()
+	GLint _prevViewport[4];
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+
+#include <GL/glew.h>
+
+
+/** \brief On-disk cache of linked shader programs.
+
+	Compiling the shaders is a noticeable part of the startup time, in
+	particular with software OpenGL implementations. Drivers supporting
+	GL_ARB_get_program_binary can return a linked program as a binary blob
+	that is loaded again much faster than the sources compile.
+
+	The blobs are stored in the "shadercache" folder of the user directory
+	(SDLWindow::GetUserDir()). A blob is named by a hash of the shader
+	sources and of the vendor, renderer and version strings of the driver,
+	so editing a shader or updating the driver selects a new file. Blobs the
+	driver rejects are deleted. Without driver support every function does
+	nothing and the sources are compiled as usual.
+*/
+class ProgramCache final
+{
+public:
+
+	/// A program linked from the given sources, taken from the cache if it
+	/// was linked before and stored in it otherwise. Throws
+	/// std::runtime_error with the info log of the failing compile or link;
+	/// owner names the class building the program in the message. Needs a
+	/// current OpenGL context.
+	static GLuint Build(const std::string& srcVertex, const std::string& srcFragment, const char* owner) noexcept(false);
+
+private:
+
+	/// Name of the cache entry of a program built from the given sources; ""
+	/// if the driver cannot save programs.
+	static std::string Key(const std::string& srcVertex, const std::string& srcFragment);
+
+	/// A new program linked from the cache entry key; 0 if there is none or
+	/// the driver does not take it.
+	static GLuint Load(const std::string& key);
+
+	/// Call before linking a program that will be stored
+	static void PrepareLink(GLuint program);
+
+	/// Saves the successfully linked program as cache entry key. Failures
+	/// are ignored, the cache is an optimization only.
+	static void Store(const std::string& key, GLuint program);
+
+	static GLuint CompileShader(GLenum shaderType, const std::string& source, const char* owner);
+	static bool IsSupported();
+	static std::string GetPath(const std::string& key);
+};
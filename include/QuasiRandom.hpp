@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "CounterRandom.hpp"
+
+
+/** \brief Owen scrambled Sobol sequence in four dimensions.
+
+	Point i of a Sobol sequence is a pure function of i, just like the draws
+	of CounterRandom, so points can be computed in any order and on any
+	thread. Unlike independent random numbers the points avoid each other:
+	every prefix of the sequence covers the unit cube evenly (no clumps, no
+	holes), which gives a smooth distribution with far fewer points.
+
+	The scrambling randomizes the sequence per key (seed, stream) without
+	destroying that property. It also removes the regular lattice patterns
+	of the plain sequence.
+
+	References:
+	Joe, Kuo, "Constructing Sobol sequences with better two-dimensional
+	projections", SIAM J. Sci. Comput. 30, 2008 (direction numbers).
+	Burley, "Practical Hash-based Owen Scrambling", JCGT 9(4), 2020.
+*/
+class QuasiRandom final
+{
+public:
+
+	static constexpr int NumDimensions = 4;
+
+	QuasiRandom(uint32_t seed, uint32_t stream)
+		: _scramble()
+	{
+		// The scramble seeds are random numbers of a counter no particle uses
+		CounterRandom(seed, stream).Block(0xFFFFFFFFu, 0xFFFFFFFFu, _scramble);
+	}
+
+	/// Coordinate dim of point index; in [0, 1)
+	float operator()(uint32_t index, int dim) const
+	{
+		return CounterRandom::ToFloat(Scramble(Sobol(index, dim), _scramble[dim]));
+	}
+
+	/// The points firstIndex ... firstIndex + count - 1 as four planes, like
+	/// CounterRandom::FillBlock: out[d * count + i] = (*this)(firstIndex + i, d)
+	void FillBlock(uint32_t firstIndex, uint32_t count, float* out) const
+	{
+		for (int d = 0; d < NumDimensions; ++d)
+		{
+			float* plane = out + d * (std::size_t)count;
+			for (uint32_t i = 0; i < count; ++i)
+				plane[i] = (*this)(firstIndex + i, d);
+		}
+	}
+
+private:
+
+	struct Directions
+	{
+		uint32_t v[NumDimensions][32];
+	};
+
+	/// Direction numbers of the first four dimensions (Joe & Kuo, 2008)
+	static constexpr Directions MakeDirections()
+	{
+		// primitive polynomial degree s, its coefficients a and the initial
+		// direction integers m of the dimensions 2 ... 4; dimension 1 is the
+		// van der Corput sequence
+		constexpr uint32_t s[NumDimensions] = { 0, 1, 2, 3 };
+		constexpr uint32_t a[NumDimensions] = { 0, 0, 1, 1 };
+		constexpr uint32_t m[NumDimensions][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+		Directions dir = {};
+		for (uint32_t k = 0; k < 32; ++k)
+			dir.v[0][k] = 1u << (31 - k);
+
+		for (int d = 1; d < NumDimensions; ++d)
+		{
+			for (uint32_t k = 0; k < 32; ++k)
+			{
+				if (k < s[d])
+				{
+					dir.v[d][k] = m[d][k] << (31 - k);
+					continue;
+				}
+
+				uint32_t v = dir.v[d][k - s[d]] ^ (dir.v[d][k - s[d]] >> s[d]);
+				for (uint32_t j = 1; j < s[d]; ++j)
+				{
+					if ((a[d] >> (s[d] - 1 - j)) & 1)
+						v ^= dir.v[d][k - j];
+				}
+
+				dir.v[d][k] = v;
+			}
+		}
+
+		return dir;
+	}
+
+	static uint32_t Sobol(uint32_t index, int dim)
+	{
+		static constexpr Directions dir = MakeDirections();
+
+		uint32_t x = 0;
+		for (int k = 0; index != 0; index >>= 1, ++k)
+		{
+			if (index & 1)
+				x ^= dir.v[dim][k];
+		}
+
+		return x;
+	}
+
+	static uint32_t ReverseBits(uint32_t x)
+	{
+		x = (x << 16) | (x >> 16);
+		x = ((x & 0x00FF00FFu) << 8) | ((x & 0xFF00FF00u) >> 8);
+		x = ((x & 0x0F0F0F0Fu) << 4) | ((x & 0xF0F0F0F0u) >> 4);
+		x = ((x & 0x33333333u) << 2) | ((x & 0xCCCCCCCCu) >> 2);
+		x = ((x & 0x55555555u) << 1) | ((x & 0xAAAAAAAAu) >> 1);
+		return x;
+	}
+
+	/// Nested uniform (Owen) scrambling via a Laine-Karras style hash: every
+	/// bit is flipped depending on the bits above it only.
+	static uint32_t Scramble(uint32_t x, uint32_t seed)
+	{
+		x = ReverseBits(x);
+		x += seed;
+		x ^= x * 0x6C50B47Cu;
+		x ^= x * 0xB82F1E52u;
+		x ^= x * 0xC7AFE638u;
+		x ^= x * 0x8D22F6E6u;
+		return ReverseBits(x);
+	}
+
+	uint32_t _scramble[NumDimensions];
+};
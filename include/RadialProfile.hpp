@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+
+/** \brief The radial profiles of a galaxy tabulated on a regular grid.
+
+	Excentricity and tilt of the density wave ellipses and the mass the
+	orbital velocity derives from, at radii 0 ... GetMaxRadius(). The table is
+	the one definition of these profiles: the CPU derives the particle
+	orbits from it and the star shader reads the very same table as a
+	texture (see VertexBufferStars). Beyond the table the profiles are
+	evaluated analytically.
+*/
+class RadialProfile final
+{
+public:
+
+	/// The galaxy parameters the profiles depend on
+	struct Param
+	{
+		float radCore = 0;
+		float radGalaxy = 0;
+		float radFarField = 0;
+		float exInner = 1;
+		float exOuter = 1;
+		float angleOffset = 0;     ///< tilt per parsec
+		float barRadius = 0;       ///< 0 = no bar
+		float barEx = 1;
+		bool hasDarkMatter = false;
+	};
+
+	/// The tabulated functions; the table holds them interleaved in this order
+	enum Channel : int
+	{
+		chExcentricity = 0,   ///< axis ratio b/a of the orbit
+		chTilt,               ///< orientation of the orbit (rad)
+		chMass,               ///< (M(r) - M(0)) / r^2 with M the mass inside r (see EvalAngularVelocity)
+		NumChannels
+	};
+
+	/// Number of table entries. Every OpenGL 3.3 implementation supports 1D
+	/// textures of this size.
+	static constexpr int NumSamples = 1024;
+
+	RadialProfile();
+
+	/// Tabulates the profiles. Does nothing if the parameters did not change.
+	void Setup(const Param& param);
+
+	const Param& GetParam() const noexcept;
+	float GetMaxRadius() const noexcept;
+
+	/// NumSamples entries of NumChannels values; entry i is at radius
+	/// i * GetMaxRadius() / (NumSamples - 1).
+	const float* GetTable() const noexcept;
+
+	/// Changes whenever the table does
+	unsigned GetVersion() const noexcept;
+
+	/// out[i] = channel ch at radius rad[i] for i in [0, num); out must not
+	/// overlap rad.
+	void Eval(Channel ch, const float* rad, float* out, std::size_t num) const;
+
+	/// out[i] = orbital velocity in degrees per year at radius rad[i]
+	void EvalAngularVelocity(const float* rad, float* out, std::size_t num) const;
+
+	static float Excentricity(const Param& param, float rad);
+	static float Tilt(const Param& param, float rad);
+
+private:
+
+	/// The mass channel: smooth and finite at r = 0 unlike the mass itself
+	/// (dominated by a central point mass near 0 and by the disc further
+	/// out) or the velocity.
+	static float MassProfile(const Param& param, float rad);
+
+	static float Analytic(const Param& param, Channel ch, float rad);
+
+	Param _param;
+	float _radMax;
+	float _mass0;    ///< mass at the center, M(0)
+	std::vector<float> _table;
+	unsigned _version;
+};
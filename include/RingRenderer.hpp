@@ -0,0 +1,79 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "RadialProfile.hpp"
+
+
+/** \brief Draws the stars, dust clouds and filaments as rigidly rotating
+	rings instead of one sprite per particle.
+
+	Excentricity, tilt and angular velocity of an orbit depend on its radius
+	only (see Galaxy::Derive), so all particles of a thin ring keep their
+	parametric angles relative to each other forever. The particles are
+	therefore splatted once into a texture over (parametric angle, ring)
+	whenever the population changes (see VertexBufferStars::Splat). Each
+	frame every ring is drawn as a strip along its orbit ellipse, rotated
+	by its angular velocity times the time. The cost of a frame depends on
+	the number of pixels and rings only, not on the number of particles.
+
+	Stars and dust move with different velocities at the same radius, so
+	each has a texture of its own (see Layer). The texels hold the light of
+	the sprites of their particles; drawing spreads it over the pixels a
+	texel covers, so the total light matches the sprites at any zoom.
+*/
+class RingRenderer final
+{
+public:
+
+	/// The textures; each holds particles sharing one angular velocity
+	enum Layer : int
+	{
+		lrStars = 0,
+		lrDust,         ///< dust clouds and filaments
+		NumLayers
+	};
+
+	static constexpr int NumRings = 1024;      ///< radial resolution
+	static constexpr int NumAngles = 2048;     ///< angular resolution of the textures
+	static constexpr int NumSegments = 256;    ///< segments of the ellipse of a ring
+
+	RingRenderer();
+	~RingRenderer();
+
+	/// Shape and angular velocity of the rings. Returns true if the radial
+	/// extent of the rings changed; the layers must be splatted again.
+	bool SetRadialProfile(const RadialProfile& profile);
+
+	/// Redirects rendering into the texture of layer and clears it. The
+	/// viewport is set to the texture; EndSplat() restores both.
+	void BeginSplat(Layer layer);
+	void EndSplat();
+
+	/// Adds a layer rotated to time to the current framebuffer. gain scales
+	/// the light of the texels (size factor, dust size, brightness).
+	void Draw(Layer layer, const glm::mat4& matProjection, float time, int pertN, float pertAmp, float gain);
+
+	void Release();
+
+private:
+	void CreateProgram();
+
+	GLuint _fbo[NumLayers];
+	GLuint _texture[NumLayers];   ///< RGBA16F, NumAngles x NumRings
+	GLuint _tableTexture;         ///< RGBA32F per ring (edge): excentricity, tilt, velocities
+	GLuint _program;
+	GLuint _vao;                  ///< empty; the vertices are computed from their index
+	GLint _projMatIdx;            ///< uniform locations
+	GLint _timeIdx;
+	GLint _pertNIdx;
+	GLint _pertAmpIdx;
+	GLint _layerIdx;
+	GLint _ringWidthIdx;
+	GLint _gainIdx;
+	float _ringWidth;             ///< pc
+	unsigned _profileVersion;     ///< RadialProfile::GetVersion() of _tableTexture
+	GLint _prevFbo;               ///< draw framebuffer bound at BeginSplat()
+	GLint _prevViewport[4];
+};
@@ -54,6 +54,7 @@ private:
 	std::vector<int> _idx;
 
 	GLuint _shaderProgram;
+	GLint _projMatIdx;    ///< uniform location in _shaderProgram
 
 	TTF_Font* _pSmallFont;
 	TTF_Font* _pFont;
@@ -62,6 +63,5 @@ private:
 	TTF_Font* GetFont(int idxFont) const;
 	const char* GetVertexShaderSource() const;
 	const char* GetFragmentShaderSource() const;
-	GLuint CreateShader(GLenum shaderType, const char** shaderSource);
 	void Clear();
 };
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <stdexcept>
@@ -11,6 +12,8 @@
 #include <glm/gtc/type_ptr.hpp>
 
 #include "Helper.hpp"
+#include "GlState.hpp"
+#include "ProgramCache.hpp"
 
 template<typename TVertex>
 class VertexBufferBase
@@ -21,12 +24,23 @@ public:
 		, _ibo(0)
 		, _vao(0)
 		, _bufferMode(GL_STATIC_DRAW)
-		, _vert()
-		, _idx()
+		, _vertCount(0)
+		, _idxCount(0)
+		, _indexed(false)
+		, _drawOrder(false)
+		, _capacity(0)
+		, _persistent(false)
+		, _ringMemory(nullptr)
+		, _ringFence()
+		, _ringSegment(0)
+		, _baseVertex(0)
 		, _shaderProgram(0)
+		, _viewMatIdx(-1)
+		, _projMatIdx(-1)
 		, _primitiveType(0)
 	{
 		_bufferMode = bufferMode;
+		_streamStride.push_back(sizeof(TVertex));
 	}
 
 	virtual ~VertexBufferBase()
@@ -40,6 +54,10 @@ public:
 		//
 
 		glGenBuffers(1, &_vbo);
+		_streamVbo.assign(_streamStride.size() - 1, 0);
+		if (!_streamVbo.empty())
+			glGenBuffers((GLsizei)_streamVbo.size(), _streamVbo.data());
+
 		glGenBuffers(1, &_ibo);
 		glGenVertexArrays(1, &_vao);
 
@@ -47,44 +65,15 @@ public:
 		// initialize Shaders and Shader Program
 		//
 
-		const char* srcVertex = GetVertexShaderSource();
-		GLuint vertexShader = CreateShader(GL_VERTEX_SHADER, &srcVertex);
-
-		const char* srcFragment = GetFragmentShaderSource();
-		GLuint fragmentShader = CreateShader(GL_FRAGMENT_SHADER, &srcFragment);
-
-		_shaderProgram = glCreateProgram();
-		glAttachShader(_shaderProgram, vertexShader);
-		glAttachShader(_shaderProgram, fragmentShader);
-		glLinkProgram(_shaderProgram);
-
-		GLint isLinked = 0;
-		glGetProgramiv(_shaderProgram, GL_LINK_STATUS, (int*)&isLinked);
-		if (isLinked == GL_FALSE)
-		{
-			GLint maxLength = 0;
-			glGetProgramiv(_shaderProgram, GL_INFO_LOG_LENGTH, &maxLength);
-
-			// The maxLength includes the NULL character
-			std::vector<GLchar> infoLog(maxLength);
-			glGetProgramInfoLog(_shaderProgram, maxLength, &maxLength, &infoLog[0]);
-
-			// clean up
-			glDeleteProgram(_shaderProgram);
-			glDeleteShader(vertexShader);
-			glDeleteShader(fragmentShader);
-
-			throw std::runtime_error("VertexBufferBase: shader program linking failed!\r\n" + std::string(infoLog.data()));
-		}
-
-		// Always detach shaders after a successful link.
-		glDetachShader(_shaderProgram, vertexShader);
-		glDetachShader(_shaderProgram, fragmentShader);
+		_shaderProgram = CreateProgram("");
+		_viewMatIdx = glGetUniformLocation(_shaderProgram, "viewMat");
+		_projMatIdx = glGetUniformLocation(_shaderProgram, "projMat");
 	}
 
-	void Release()
+	virtual void Release()
 	{
 		ReleaseAttribArray();
+		ReleaseStream();
 
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
@@ -93,6 +82,10 @@ public:
 		if (_vbo != 0)
 			glDeleteBuffers(1, &_vbo);
 
+		if (!_streamVbo.empty())
+			glDeleteBuffers((GLsizei)_streamVbo.size(), _streamVbo.data());
+		_streamVbo.clear();
+
 		if (_ibo != 0)
 			glDeleteBuffers(1, &_ibo);
 
@@ -100,55 +93,269 @@ public:
 			glDeleteVertexArrays(1, &_vao);
 	}
 
+	/// Uploads vertices and indices. The buffer keeps no copy of them.
 	void CreateBuffer(const std::vector<TVertex>& vert, const std::vector<int>& idx, GLuint type)  noexcept(false)
 	{
 		CHECK_GL_ERROR
 
-		_vert = vert;
-		_idx = idx;
+		_idxCount = idx.size();
+		_indexed = true;
+		_drawOrder = false;
 		_primitiveType = type;
+		UploadVertices(vert);
 
-		glBindBuffer(GL_ARRAY_BUFFER, _vbo);
-		glBufferData(GL_ARRAY_BUFFER, _vert.size() * sizeof(TVertex), _vert.data(), _bufferMode);
+		// Set up index buffer array
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, idx.size() * sizeof(int), idx.data(), GL_STATIC_DRAW);
 		CHECK_GL_ERROR
 
-		glBindVertexArray(_vao);
+		SetupVertexArray();
+	}
+
+	/// Uploads vertices that are drawn in their order, without an index
+	/// array (i.e. points or line lists).
+	void CreateBuffer(const std::vector<TVertex>& vert, GLuint type)  noexcept(false)
+	{
+		CHECK_GL_ERROR
+
+		_idxCount = 0;
+		_indexed = false;
+		_drawOrder = false;
+		_primitiveType = type;
+		UploadVertices(vert);
+
+		// Drop the indices of an earlier indexed buffer
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+		CHECK_GL_ERROR
 
-		// Set up vertex buffer array
-		glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+		SetupVertexArray();
+	}
 
-		// Set up vertex buffer attributes
-		for (const AttributeDefinition &attrib : _attributes)
+	/// Replaces "removed" vertices at "first" by "inserted" new ones. The
+	/// vertices behind them are moved on the GPU and the buffer grows
+	/// geometrically, so growing or trimming a large buffer does not upload
+	/// it again. Only for buffers drawn without indices; a draw order (see
+	/// SetDrawOrder) is dropped. The content of the inserted vertices must
+	/// be set with UpdateRange or FillRange afterwards.
+	void Splice(std::size_t first, std::size_t removed, std::size_t inserted, GLuint type) noexcept(false)
+	{
+		CHECK_GL_ERROR
+
+		if (_indexed && !_drawOrder)
+			throw std::runtime_error("VertexBufferBase::Splice: indexed buffers cannot be spliced!");
+
+		if (_bufferMode == GL_STREAM_DRAW)
+			throw std::runtime_error("VertexBufferBase::Splice: streaming buffers cannot be spliced!");
+
+		const std::size_t count = _vertCount;
+		if (first + removed > count)
+			throw std::runtime_error("VertexBufferBase::Splice: range out of bounds!");
+
+		const std::size_t tail = count - first - removed;
+		const std::size_t newCount = count - removed + inserted;
+		_primitiveType = type;
+		_vertCount = newCount;
+
+		const bool grow = newCount > _capacity;
+		const std::size_t capacity = (grow) ? std::max(newCount, _capacity + _capacity / 2) : _capacity;
+		for (std::size_t stream = 0; stream < _streamStride.size(); ++stream)
 		{
-			glEnableVertexAttribArray(attrib.attribIdx);
-			if (attrib.type == GL_INT)
+			GLuint& buffer = StreamBuffer(stream);
+			const std::size_t vs = _streamStride[stream];
+			if (grow)
 			{
-				glVertexAttribIPointer(attrib.attribIdx, attrib.size, GL_INT, sizeof(TVertex), (GLvoid*)attrib.offset);
+				// Allocate a larger buffer and copy the kept vertices straight to
+				// their new positions.
+				GLuint vbo = 0;
+				glGenBuffers(1, &vbo);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, vbo);
+				glBufferData(GL_COPY_WRITE_BUFFER, capacity * vs, nullptr, _bufferMode);
+
+				// Nothing to keep if everything is replaced
+				if (first > 0 || tail > 0)
+				{
+					glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+					if (first > 0)
+						glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, first * vs);
+
+					if (tail > 0)
+						glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (first + removed) * vs, (first + inserted) * vs, tail * vs);
+				}
+
+				glDeleteBuffers(1, &buffer);
+				buffer = vbo;
 			}
-			else
+			else if (tail > 0 && removed != inserted)
 			{
-				glVertexAttribPointer(attrib.attribIdx, attrib.size, attrib.type, GL_FALSE, sizeof(TVertex), (GLvoid*)attrib.offset);
+				// Source and destination of a copy must not overlap: move the tail
+				// through a scratch buffer.
+				GLuint scratch = 0;
+				glGenBuffers(1, &scratch);
+				glBindBuffer(GL_COPY_WRITE_BUFFER, scratch);
+				glBufferData(GL_COPY_WRITE_BUFFER, tail * vs, nullptr, GL_STREAM_COPY);
+				glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, (first + removed) * vs, 0, tail * vs);
+				glCopyBufferSubData(GL_COPY_WRITE_BUFFER, GL_COPY_READ_BUFFER, 0, (first + inserted) * vs, tail * vs);
+				glDeleteBuffers(1, &scratch);
 			}
 		}
+		_capacity = capacity;
+
+		// The order refers to the old vertex positions
+		_indexed = false;
+		_drawOrder = false;
+		_idxCount = 0;
+
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 		CHECK_GL_ERROR
 
-		// Set up index buffer array
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, _idx.size() * sizeof(int), _idx.data(), GL_STATIC_DRAW);
+		SetupVertexArray();
+	}
+
+	/// Overwrites count vertices starting at first.
+	void UpdateRange(std::size_t first, const TVertex* vert, std::size_t count) noexcept(false)
+	{
+		if (first + count > _vertCount)
+			throw std::runtime_error("VertexBufferBase::UpdateRange: range out of bounds!");
+
+		if (_bufferMode == GL_STREAM_DRAW)
+			throw std::runtime_error("VertexBufferBase::UpdateRange: streaming buffers are replaced as a whole!");
+
+		if (_streamStride.size() != 1)
+			throw std::runtime_error("VertexBufferBase::UpdateRange: the buffer has several attribute streams!");
+
+		if (count == 0)
+			return;
+
+		glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+		glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(TVertex), count * sizeof(TVertex), vert);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		CHECK_GL_ERROR
+	}
+
+	/// Overwrites count vertices starting at first without a staging copy:
+	/// fill(TVertex* vert) is called with the buffer range mapped into memory
+	/// and must write all count vertices. It may hand the work to other
+	/// threads but must not return before they are done.
+	template<typename TFill>
+	void FillRange(std::size_t first, std::size_t count, const TFill& fill) noexcept(false)
+	{
+		if (_streamStride.size() != 1)
+			throw std::runtime_error("VertexBufferBase::FillRange: the buffer has several attribute streams!");
+
+		FillStreams(1, first, count, [&](void* const* mem) { fill(static_cast<TVertex*>(mem[0])); });
+	}
+
+	/// FillRange for buffers with several attribute streams (see
+	/// DefineStreams): fill(void* const* mem) gets the mapped range of
+	/// stream s in mem[s] for every bit s set in streamMask. The other
+	/// streams keep their content.
+	template<typename TFill>
+	void FillStreams(uint32_t streamMask, std::size_t first, std::size_t count, const TFill& fill) noexcept(false)
+	{
+		if (first + count > _vertCount)
+			throw std::runtime_error("VertexBufferBase::FillStreams: range out of bounds!");
+
+		if (_bufferMode == GL_STREAM_DRAW)
+			throw std::runtime_error("VertexBufferBase::FillStreams: streaming buffers are replaced as a whole!");
+
+		if (count == 0 || streamMask == 0)
+			return;
+
+		// Unmapping fails if the content of the buffer got lost meanwhile
+		// (i.e. a display mode change); fill it again then.
+		std::vector<void*> mem(_streamStride.size(), nullptr);
+		for (int attempt = 0;; ++attempt)
+		{
+			try
+			{
+				for (std::size_t stream = 0; stream < mem.size(); ++stream)
+				{
+					if ((streamMask & (1u << stream)) == 0)
+						continue;
+
+					const std::size_t vs = _streamStride[stream];
+					glBindBuffer(GL_ARRAY_BUFFER, StreamBuffer(stream));
+					mem[stream] = glMapBufferRange(GL_ARRAY_BUFFER, first * vs, count * vs, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+					if (mem[stream] == nullptr)
+						throw std::runtime_error("VertexBufferBase::FillStreams: mapping the buffer failed!");
+				}
+
+				fill(mem.data());
+			}
+			catch (...)
+			{
+				UnmapStreams(mem);
+				throw;
+			}
+
+			if (UnmapStreams(mem))
+				break;
+
+			if (attempt == 2)
+				throw std::runtime_error("VertexBufferBase::FillStreams: buffer content lost!");
+		}
+
 		CHECK_GL_ERROR
+	}
 
+	std::size_t GetVertexCount() const
+	{
+		return _vertCount;
+	}
+
+	/// Draws the vertices of a buffer created without indices in the given
+	/// order: element i of the draw ranges is vertex order[i]. Unlike the
+	/// indices of an indexed buffer the order does not restrict Splice; it
+	/// is dropped by it and must be set again afterwards.
+	void SetDrawOrder(const std::vector<GLuint>& order) noexcept(false)
+	{
+		if (_indexed && !_drawOrder)
+			throw std::runtime_error("VertexBufferBase::SetDrawOrder: the buffer has indices!");
+
+		glBindVertexArray(_vao);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, order.size() * sizeof(GLuint), order.data(), GL_DYNAMIC_DRAW);
 		glBindVertexArray(0);
 		CHECK_GL_ERROR
+
+		_idxCount = order.size();
+		_indexed = true;
+		_drawOrder = true;
 	}
 
+	/// Whether the buffer is drawn in the order of SetDrawOrder
+	bool HasDrawOrder() const noexcept
+	{
+		return _drawOrder;
+	}
+
+	/// Restricts drawing to count[i] elements starting at element first[i]
+	/// for every range i. Elements are indices of an indexed buffer and
+	/// vertices otherwise. No ranges = draw the whole buffer.
+	void SetDrawRanges(const std::vector<GLint>& first, const std::vector<GLsizei>& count)
+	{
+		_rangeFirst = first;
+		_rangeCount = count;
+	}
+
+	/// Overwrites the vertices. A streaming buffer (GL_STREAM_DRAW) takes
+	/// all of vert as its new content, others keep their size.
 	void UpdateBuffer(const std::vector<TVertex>& vert) noexcept(false)
 	{
 		if (_bufferMode == GL_STATIC_DRAW)
 			throw std::runtime_error("VertexBufferBase: static buffers cannot be updated!");
 
+		if (_bufferMode == GL_STREAM_DRAW)
+		{
+			UploadVertices(vert);
+			return;
+		}
+
 		glBindBuffer(GL_ARRAY_BUFFER, _vbo);
-		glBufferSubData(GL_ARRAY_BUFFER, 0, _vert.size() * sizeof(TVertex), vert.data());
+		glBufferSubData(GL_ARRAY_BUFFER, 0, std::min(vert.size(), _vertCount) * sizeof(TVertex), vert.data());
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
@@ -158,37 +365,28 @@ public:
 	virtual void Draw(glm::mat4& matView, glm::mat4& matProjection)
 	{
 		CHECK_GL_ERROR
-		glUseProgram(_shaderProgram);
-
-		GLuint viewMatIdx = glGetUniformLocation(_shaderProgram, "viewMat");
-		glUniformMatrix4fv(viewMatIdx, 1, GL_FALSE, glm::value_ptr(matView));
-
-		GLuint projMatIdx = glGetUniformLocation(_shaderProgram, "projMat");
-		glUniformMatrix4fv(projMatIdx, 1, GL_FALSE, glm::value_ptr(matProjection));
+		GlState::UseProgram(_shaderProgram);
+		glUniformMatrix4fv(_viewMatIdx, 1, GL_FALSE, glm::value_ptr(matView));
+		glUniformMatrix4fv(_projMatIdx, 1, GL_FALSE, glm::value_ptr(matProjection));
 
 		OnSetCustomShaderVariables();
 
-		glEnable(GL_PRIMITIVE_RESTART);
-		glEnable(GL_BLEND);
-		glPrimitiveRestartIndex(0xFFFF);
-		CHECK_GL_ERROR
-
-		glEnable(GL_PROGRAM_POINT_SIZE);
+		// Primitive restart only concerns the index buffer; a draw order
+		// may hold any vertex index
+		GlState::Set(GL_PRIMITIVE_RESTART, _indexed && !_drawOrder);
+		if (_indexed && !_drawOrder)
+			glPrimitiveRestartIndex(0xFFFF);
+
+		// Additive blending like the stars and the text overlays
+		GlState::Enable(GL_BLEND);
+		GlState::BlendFunc(GL_SRC_ALPHA, GL_ONE);
+		GlState::BlendEquation(GL_FUNC_ADD);
+		GlState::Enable(GL_PROGRAM_POINT_SIZE);
 		CHECK_GL_ERROR
 
 		OnBeforeDraw();
 
-		glBindVertexArray(_vao);
-		glDrawElements(_primitiveType, (int)_idx.size(), GL_UNSIGNED_INT, nullptr);
-		glBindVertexArray(0);
-		CHECK_GL_ERROR
-
-		glDisable(GL_PROGRAM_POINT_SIZE);
-		glDisable(GL_BLEND);
-		glDisable(GL_PRIMITIVE_RESTART);
-		CHECK_GL_ERROR
-
-		glUseProgram(0);
+		DrawPrimitives();
 		CHECK_GL_ERROR
 	}
 
@@ -206,16 +404,31 @@ public:
 
 protected:
 
+	/// A vertex attribute. GL_FLOAT and GL_HALF_FLOAT attributes are read as
+	/// floats. Integer types are read as integers (ivec/uvec in the shader)
+	/// unless normalized is set; then they are mapped to [0, 1] (unsigned) or
+	/// [-1, 1] (signed) floats.
 	struct AttributeDefinition
 	{
 		int attribIdx;
 		int size;
 		int type;
-		uintptr_t offset;
+		uintptr_t offset;          ///< within the vertex of the stream
+		bool normalized = false;
+		std::size_t stream = 0;    ///< attribute stream (see DefineStreams)
 	};
 
 	GLuint _bufferMode;
 
+	/// Splits the vertices into attribute streams held in separate buffers
+	/// (structure of arrays); stream s has stride[s] bytes per vertex. Each
+	/// stream can be written on its own (see FillStreams). Without this call
+	/// the buffer has the single stream of TVertex.
+	void DefineStreams(const std::vector<std::size_t>& stride)
+	{
+		_streamStride = stride;
+	}
+
 	void DefineAttributes(std::vector<AttributeDefinition> attribList)
 	{
 		_attributes.clear();
@@ -231,9 +444,55 @@ protected:
 		return _primitiveType;
 	}
 
+	/// Number of elements drawn: indices of an indexed buffer, vertices otherwise
 	int GetArrayElementCount() const
 	{
-		return (int)_idx.size();
+		return (int)(_indexed ? _idxCount : _vertCount);
+	}
+
+	/// Draws count elements starting at element first, regardless of the
+	/// draw ranges
+	void DrawRange(GLint first, GLsizei count)
+	{
+		glBindVertexArray(_vao);
+		if (_indexed)
+			glDrawElementsBaseVertex(_primitiveType, count, GL_UNSIGNED_INT, (void*)(first * sizeof(int)), _baseVertex);
+		else
+			glDrawArrays(_primitiveType, _baseVertex + first, count);
+		glBindVertexArray(0);
+		FenceStream();
+	}
+
+	/// Issues the draw call of the buffer with the program and state set up
+	void DrawPrimitives()
+	{
+		glBindVertexArray(_vao);
+		if (_rangeFirst.empty())
+		{
+			if (_indexed)
+				glDrawElementsBaseVertex(_primitiveType, (GLsizei)_idxCount, GL_UNSIGNED_INT, nullptr, _baseVertex);
+			else
+				glDrawArrays(_primitiveType, _baseVertex, (GLsizei)_vertCount);
+		}
+		else
+		{
+			MultiDraw(_rangeFirst, _rangeCount);
+		}
+		glBindVertexArray(0);
+		FenceStream();
+	}
+
+	/// Draws count[i] elements starting at element first[i] for every range
+	/// i, regardless of the draw ranges
+	void DrawRanges(const std::vector<GLint>& first, const std::vector<GLsizei>& count)
+	{
+		if (first.empty())
+			return;
+
+		glBindVertexArray(_vao);
+		MultiDraw(first, count);
+		glBindVertexArray(0);
+		FenceStream();
 	}
 
 	GLuint GetShaderProgramm() const
@@ -253,47 +512,259 @@ private:
 
 	std::vector<AttributeDefinition> _attributes;
 
+	/// Binds the buffers and the vertex attributes to the vertex array object.
+	void SetupVertexArray()
+	{
+		glBindVertexArray(_vao);
+
+		// Set up vertex buffer attributes, each one in the buffer of its stream
+		for (const AttributeDefinition &attrib : _attributes)
+		{
+			const GLsizei stride = (GLsizei)_streamStride[attrib.stream];
+			glBindBuffer(GL_ARRAY_BUFFER, StreamBuffer(attrib.stream));
+			glEnableVertexAttribArray(attrib.attribIdx);
+			if (attrib.type == GL_FLOAT || attrib.type == GL_HALF_FLOAT || attrib.normalized)
+			{
+				glVertexAttribPointer(attrib.attribIdx, attrib.size, attrib.type, attrib.normalized ? GL_TRUE : GL_FALSE, stride, (GLvoid*)attrib.offset);
+			}
+			else
+			{
+				glVertexAttribIPointer(attrib.attribIdx, attrib.size, attrib.type, stride, (GLvoid*)attrib.offset);
+			}
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		CHECK_GL_ERROR
+
+		// Set up index buffer array
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _ibo);
+
+		glBindVertexArray(0);
+		CHECK_GL_ERROR
+	}
+
+	/// One draw call for several element ranges; the vertex array object
+	/// must be bound
+	void MultiDraw(const std::vector<GLint>& first, const std::vector<GLsizei>& count)
+	{
+		if (_indexed)
+		{
+			std::vector<void*> offsets(first.size());
+			std::vector<GLint> baseVertex(first.size(), _baseVertex);
+			for (std::size_t i = 0; i < offsets.size(); ++i)
+				offsets[i] = (void*)(first[i] * sizeof(int));
+
+			// GLEW declares the counts non-const
+			glMultiDrawElementsBaseVertex(_primitiveType, const_cast<GLsizei*>(count.data()), GL_UNSIGNED_INT, offsets.data(), (GLsizei)offsets.size(), baseVertex.data());
+		}
+		else
+		{
+			std::vector<GLint> vertFirst(first);
+			for (GLint& f : vertFirst)
+				f += _baseVertex;
+
+			glMultiDrawArrays(_primitiveType, vertFirst.data(), count.data(), (GLsizei)vertFirst.size());
+		}
+	}
+
+	/// The vertex buffer of stream 0 is _vbo, the others are in _streamVbo
+	GLuint& StreamBuffer(std::size_t stream)
+	{
+		return (stream == 0) ? _vbo : _streamVbo[stream - 1];
+	}
+
+	/// Unmaps the buffers of FillStreams; false if the content of one of
+	/// them got lost.
+	bool UnmapStreams(std::vector<void*>& mem)
+	{
+		bool intact = true;
+		for (std::size_t stream = 0; stream < mem.size(); ++stream)
+		{
+			if (mem[stream] == nullptr)
+				continue;
+
+			glBindBuffer(GL_ARRAY_BUFFER, StreamBuffer(stream));
+			intact &= (glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE);
+			mem[stream] = nullptr;
+		}
+
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		return intact;
+	}
+
 	// Vertex buffer object
 	GLuint _vbo;
 
+	std::vector<GLuint> _streamVbo;        ///< vertex buffers of the streams 1 ...
+	std::vector<std::size_t> _streamStride; ///< bytes per vertex of each stream
+
 	// Index Buffer Object
 	GLuint _ibo;
 
 	// vertex array object
 	GLuint _vao;
 
-	std::vector<TVertex> _vert;
-	std::vector<int> _idx;
+	std::size_t _vertCount;     ///< number of vertices in the vertex buffer
+	std::size_t _idxCount;      ///< number of indices in the index buffer
+	bool _indexed;              ///< drawn with the index buffer (see CreateBuffer)
+	bool _drawOrder;            ///< the index buffer holds a draw order (see SetDrawOrder)
+
+	std::size_t _capacity;      ///< number of vertices the vertex buffer (a ring segment when streaming) can hold
+
+	// Streaming buffers (GL_STREAM_DRAW) with GL_ARB_buffer_storage are a
+	// persistently mapped ring of RingSegments copies of the vertices. The
+	// CPU writes one segment while the GPU may still read the others.
+	static constexpr int RingSegments = 3;
+	bool _persistent;                   ///< the ring is set up
+	char* _ringMemory;                  ///< the mapped ring
+	GLsync _ringFence[RingSegments];    ///< completion of the last draw of each segment
+	int _ringSegment;                   ///< segment drawn from
+	GLint _baseVertex;                  ///< first vertex of the segment drawn from
 
 	GLuint _shaderProgram;
+	GLint _viewMatIdx;          ///< uniform locations of _shaderProgram
+	GLint _projMatIdx;
 
 	GLuint _primitiveType;
 
-	GLuint CreateShader(GLenum shaderType, const char** shaderSource)
+	std::vector<GLint> _rangeFirst;    ///< see SetDrawRanges
+	std::vector<GLsizei> _rangeCount;
+
+	/// Sets the vertices and their count, keeping the index buffer.
+	void UploadVertices(const std::vector<TVertex>& vert)
+	{
+		if (_streamStride.size() != 1)
+			throw std::runtime_error("VertexBufferBase: the buffer has several attribute streams!");
+
+		_vertCount = vert.size();
+		if (_bufferMode == GL_STREAM_DRAW)
+		{
+			WriteStream(vert.data(), vert.size());
+			return;
+		}
+
+		_capacity = _vertCount;
+		glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+		glBufferData(GL_ARRAY_BUFFER, vert.size() * sizeof(TVertex), vert.data(), _bufferMode);
+		CHECK_GL_ERROR
+	}
+
+	/// Writes the content of a streaming buffer without waiting for the
+	/// draws of the previous content. With buffer storage the vertices go to
+	/// the next segment of the ring; its fence only blocks if the GPU is more
+	/// than two updates behind. Without, the buffer is orphaned: the driver
+	/// hands out fresh memory while the old one is still in use.
+	void WriteStream(const TVertex* vert, std::size_t count)
 	{
-		GLuint shader = glCreateShader(shaderType);
-		glShaderSource(shader, 1, shaderSource, nullptr);
-		glCompileShader(shader);
+		const bool useStorage = GLEW_ARB_buffer_storage != 0;
+		if (count > _capacity || (_persistent != useStorage && count > 0))
+		{
+			ReleaseStream();
+
+			const std::size_t capacity = std::max(count, _capacity + _capacity / 2);
+			if (useStorage)
+			{
+				// Immutable storage cannot be resized, it needs a new buffer
+				const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glDeleteBuffers(1, &_vbo);
+				glGenBuffers(1, &_vbo);
+				glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+				glBufferStorage(GL_ARRAY_BUFFER, RingSegments * capacity * sizeof(TVertex), nullptr, flags);
+				_ringMemory = (char*)glMapBufferRange(GL_ARRAY_BUFFER, 0, RingSegments * capacity * sizeof(TVertex), flags);
+				if (_ringMemory == nullptr)
+					throw std::runtime_error("VertexBufferBase: mapping the streaming buffer failed!");
+
+				_persistent = true;
+				SetupVertexArray();
+			}
+
+			_capacity = capacity;
+		}
 
-		GLint isCompiled = 0;
-		glGetShaderiv(shader, GL_COMPILE_STATUS, &isCompiled);
-		if (isCompiled == GL_FALSE)
+		if (_persistent)
 		{
-			GLint maxLength = 0;
-			glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &maxLength);
+			_ringSegment = (_ringSegment + 1) % RingSegments;
+			GLsync& fence = _ringFence[_ringSegment];
+			if (fence != nullptr)
+			{
+				GLenum res = GL_TIMEOUT_EXPIRED;
+				while (res == GL_TIMEOUT_EXPIRED)
+					res = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
 
-			// The maxLength includes the NULL character
-			std::vector<GLchar> infoLog(maxLength);
-			glGetShaderInfoLog(shader, maxLength, &maxLength, &infoLog[0]);
+				glDeleteSync(fence);
+				fence = nullptr;
+			}
 
-			std::string msg(infoLog.data());
+			std::copy(vert, vert + count, (TVertex*)_ringMemory + _ringSegment * _capacity);
+			_baseVertex = (GLint)(_ringSegment * _capacity);
+		}
+		else
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+			glBufferData(GL_ARRAY_BUFFER, _capacity * sizeof(TVertex), nullptr, GL_STREAM_DRAW);
+			glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(TVertex), vert);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+			_baseVertex = 0;
+		}
+		CHECK_GL_ERROR
+	}
 
-			// We don't need the shader anymore.
-			glDeleteShader(shader);
+	/// Marks the segment of the ring as in use by the draws issued so far
+	void FenceStream()
+	{
+		if (!_persistent)
+			return;
+
+		GLsync& fence = _ringFence[_ringSegment];
+		if (fence != nullptr)
+			glDeleteSync(fence);
+
+		fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void ReleaseStream()
+	{
+		for (GLsync& fence : _ringFence)
+		{
+			if (fence != nullptr)
+				glDeleteSync(fence);
+			fence = nullptr;
+		}
 
-			throw std::runtime_error(std::string("VertecBuffer: Shader compilation failed: ") + msg);
+		if (_persistent)
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, _vbo);
+			glUnmapBuffer(GL_ARRAY_BUFFER);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
 		}
 
-		return shader;
+		_persistent = false;
+		_ringMemory = nullptr;
+		_ringSegment = 0;
+		_baseVertex = 0;
+	}
+
+protected:
+
+	/// Compiles and links the shader sources of the buffer. The preprocessor
+	/// definitions in defines are inserted behind the #version line of both
+	/// shaders, so one source can yield several specialized programs.
+	/// Programs linked before are taken from the ProgramCache.
+	GLuint CreateProgram(const std::string& defines) noexcept(false)
+	{
+		const std::string srcVertex = InsertDefines(GetVertexShaderSource(), defines);
+		const std::string srcFragment = InsertDefines(GetFragmentShaderSource(), defines);
+
+		return ProgramCache::Build(srcVertex, srcFragment, "VertexBufferBase");
+	}
+
+	static std::string InsertDefines(const char* source, const std::string& defines)
+	{
+		std::string src(source);
+		if (defines.empty())
+			return src;
+
+		const std::size_t pos = src.find('\n');
+		src.insert((pos == std::string::npos) ? src.size() : pos + 1, defines);
+		return src;
 	}
 };
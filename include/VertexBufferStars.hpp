@@ -1,55 +1,298 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
 #include "VertexBufferBase.hpp"
+#include "GlDebug.hpp"
+#include "RadialProfile.hpp"
+#include "RingRenderer.hpp"
+
+/** \brief A Star packed into 16 bytes for rendering.
+
+	The shader only needs a fraction of the precision of Star: the positions
+	derived from the packed values are accurate to about 1e-3 of the radius,
+	well below a pixel at any zoom level of the viewer. The velocity keeps
+	full precision since its error grows with the simulation time. The color
+	is looked up from the temperature index in the shader (see
+	Helper::ColorTable).
 
+	Each 4 byte word is one attribute stream of VertexBufferStars (see
+	VertexBufferStars::Stream), so a parameter change only uploads the
+	words it affects.
+*/
 struct VertexStar
 {
-	Star star;
-	Color col;
+	float velTheta;       ///< angular velocity (deg/yr)
+	uint16_t thetaType;   ///< bits 3..15: initial angle (360 / 8192 deg); bits 0..2: type
+	uint8_t colorIdx;     ///< index into Helper::ColorTable()
+	uint8_t mag;          ///< square root of the magnitude (normalized)
+	uint16_t axes[2];     ///< semi-major and semi-minor axis in kpc (half float)
+	int16_t tilt[2];      ///< cos and sin of the tilt angle (normalized)
+
+	static VertexStar FromStar(const Star& star)
+	{
+		VertexStar vert;
+		FromStars(&star, 1, &vert);
+		return vert;
+	}
+
+	/// FromStar of num stars; the colors are looked up in batches
+	static void FromStars(const Star* star, std::size_t num, VertexStar* vert)
+	{
+		for (std::size_t i = 0; i < num; ++i)
+		{
+			const Star& s = star[i];
+			const float theta = s.theta0 - 360.0f * std::floor(s.theta0 / 360.0f);
+
+			VertexStar& v = vert[i];
+			v.velTheta = s.velTheta;
+			v.thetaType = (uint16_t)((((uint32_t)std::lround(theta * (8192.0f / 360.0f)) & 0x1FFF) << 3) | (s.type & 7));
+			v.axes[0] = ToHalf(s.a / 1000.0f);
+			v.axes[1] = ToHalf(s.b / 1000.0f);
+			v.tilt[0] = (int16_t)std::lround(std::cos(s.tiltAngle) * 32767.0f);
+			v.tilt[1] = (int16_t)std::lround(std::sin(s.tiltAngle) * 32767.0f);
+			v.mag = (uint8_t)std::lround(std::sqrt(std::clamp(s.mag, 0.0f, 1.0f)) * 255.0f);
+		}
+
+		// The temperatures are gathered into a plane so the conversion
+		// vectorizes
+		constexpr std::size_t BatchSize = 256;
+		float temp[BatchSize];
+		uint8_t colorIdx[BatchSize];
+		for (std::size_t begin = 0; begin < num; begin += BatchSize)
+		{
+			const std::size_t count = std::min(BatchSize, num - begin);
+			for (std::size_t i = 0; i < count; ++i)
+				temp[i] = star[begin + i].temp;
+
+			Helper::ColorIndicesFromTemperatures(temp, colorIdx, count);
+			for (std::size_t i = 0; i < count; ++i)
+				vert[begin + i].colorIdx = colorIdx[i];
+		}
+	}
+
+private:
+
+	/// IEEE half float of a finite value, rounded to nearest even. Values
+	/// beyond the half range are clamped.
+	static uint16_t ToHalf(float value)
+	{
+		uint32_t x;
+		std::memcpy(&x, &value, sizeof(x));
+
+		const uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+		x &= 0x7FFFFFFF;
+
+		if (x >= 0x477FE000)   // 65504, the largest half
+			return sign | 0x7BFF;
+
+		if (x < 0x38800000)    // 2^-14, below the smallest normal half
+		{
+			float abs;
+			std::memcpy(&abs, &x, sizeof(abs));
+			return sign | (uint16_t)std::lround(abs * 16777216.0f);
+		}
+
+		x += 0x0FFF + ((x >> 13) & 1);
+		return sign | (uint16_t)((x - 0x38000000) >> 13);
+	}
 };
 
+static_assert(sizeof(VertexStar) == 16, "VertexStar is expected to be 16 bytes");
+static_assert(offsetof(VertexStar, thetaType) == 4 && offsetof(VertexStar, axes) == 8 && offsetof(VertexStar, tilt) == 12,
+	"one 4 byte word per attribute stream");
+
 class VertexBufferStars : public VertexBufferBase<VertexStar>
 {
 public:
 
-	/// Parameters of the H2 region shader model: the density wave shape needed
-	/// to locate the neighbouring waves plus the ignition tuning values.
+	/// The attribute streams; stream s holds word s of VertexStar
+	enum Stream : int
+	{
+		stVelocity = 0,   ///< velTheta
+		stLook,           ///< initial angle, type, color and magnitude
+		stAxes,           ///< semi-major and semi-minor axis
+		stTilt,           ///< orientation of the orbit
+		NumStreams
+	};
+
+	/// The particle classes; each one is drawn as its own range with a
+	/// shader program specialized for it. The order matches the bits of the
+	/// displayFeatures mask (see UpdateShaderVariables).
+	enum ParticleClass : int
+	{
+		pcStars = 0,
+		pcDust,
+		pcFilaments,
+		pcH2,           ///< H2 regions, both halo (type 3) and core (type 4)
+		NumParticleClasses
+	};
+
+	/// Number of radial shells per particle class (see Shells)
+	static constexpr int NumShells = 64;
+
+	/** \brief The particles of a class sorted by the distance of their orbit
+		from the center.
+
+		Shell s holds the particles whose orbit ellipse comes no closer to the
+		center than s * width; they are the count[s] elements starting at
+		first[s] of the draw order (see SetDrawOrder). Within a shell the
+		particles keep the order of the class, so a prefix of each shell is
+		a representative subset like a prefix of the class.
+	*/
+	struct Shells
+	{
+		float width = 0;
+		float maxA[NumShells] = {};   ///< largest semi-major axis in a shell; bounds the density wave perturbation
+		GLint first[NumShells] = {};
+		GLsizei count[NumShells] = {};
+	};
+
+	/** \brief Sorts the count particles starting at index first of stars into
+		radial shells.
+
+		The closest approach of an orbit ellipse to the center is its smaller
+		semi-axis. The random walk of the filaments may give a particle
+		negative semi-axes; its ellipse is the one of their absolute values
+		turned by 180 degrees, so the absolute values are binned. A counting
+		sort keeps the order of the particles within a shell, so the level of
+		detail can still draw a prefix of each shell.
+
+		\param order receives the indices of the particles in the draw order
+		       at the same positions first ... first + count - 1
+	*/
+	static void SortIntoShells(const Star* stars, std::size_t first, std::size_t count, GLuint* order, Shells& shells)
+	{
+		const Star* begin = stars + first;
+		const Star* end = begin + count;
+		auto innerOf = [](const Star& star)
+		{
+			return std::min(std::abs(star.a), std::abs(star.b));
+		};
+
+		float maxInner = 0;
+		for (const Star* star = begin; star != end; ++star)
+			maxInner = std::max(maxInner, innerOf(*star));
+
+		shells = Shells();
+		shells.width = std::max(maxInner, 1.0f) / NumShells;
+		auto shellOf = [&](const Star& star)
+		{
+			return std::clamp((int)(innerOf(star) / shells.width), 0, NumShells - 1);
+		};
+
+		for (const Star* star = begin; star != end; ++star)
+		{
+			const int s = shellOf(*star);
+			++shells.count[s];
+			shells.maxA[s] = std::max(shells.maxA[s], std::abs(star->a));
+		}
+
+		GLint next[NumShells];
+		GLint pos = (GLint)first;
+		for (int s = 0; s < NumShells; ++s)
+		{
+			shells.first[s] = next[s] = pos;
+			pos += shells.count[s];
+		}
+
+		for (const Star* star = begin; star != end; ++star)
+			order[next[shellOf(*star)]++] = (GLuint)(star - stars);
+	}
+
+	/// Tuning values of the H2 region shader model. The density wave shape
+	/// needed to locate the neighbouring waves comes from the radial profile
+	/// (see SetRadialProfile).
 	struct H2Params
 	{
-		float radCore;      ///< radius of the galaxy core (see Galaxy::GetExcentricity)
-		float radGalaxy;    ///< radius of the galaxy disc
-		float radFarField;  ///< radius beyond which the waves become circular
-		float exInner;      ///< excentricity at the core edge
-		float exOuter;      ///< excentricity at the disc edge
-		float angleOffset;  ///< ellipse tilt per parsec (the spiral twist)
 		float sizeMax;      ///< point size of a fully ignited region (px)
 		float threshold;    ///< density enhancement rho at which a region ignites
 		float barRadius;    ///< bar semi-major axis (pc); 0 = no bar
-		float barEx;        ///< axis ratio of the bar orbits
 	};
 	VertexBufferStars(GLuint blendEquation, GLuint blendFunc)
-		: VertexBufferBase(GL_STATIC_DRAW)
+		: VertexBufferBase(GL_DYNAMIC_DRAW)
 		, _pertN(0)
 		, _dustSize(0)
 		, _pertAmp(0)
 		, _time(0)
 		, _blendFunc(blendFunc)
 		, _blendEquation(blendEquation)
+		, _displayFeatures(0)
 		, _sizeFactor(1)
+		, _brightnessGain(1)
+		, _profileTexture(0)
+		, _profileVersion(0)
+		, _profileScale(0)
+		, _colorTexture(0)
+		, _paramBuffer(0)
+		, _params()
+		, _paramsUploaded(false)
+		, _programs()
+		, _dustGridProgram(0)
+		, _splatPrograms()
+		, _crowdingProgram(0)
+		, _crowdingTexture(0)
+		, _crowdingFbo(0)
+		, _crowdingVao(0)
+		, _crowdingKey()
+		, _dustGrid(false)
+		, _classFirst()
+		, _classCount()
+		, _classDetail()
+		, _shells()
+		, _cullRadius(-1)
 	{
+		DefineStreams({ 4, 4, 4, 4 });
 		DefineAttributes({
-			{ attTheta0,        1, GL_FLOAT, offsetof(Star, theta0) },
-			{ attVelTheta,      1, GL_FLOAT, offsetof(Star, velTheta) },
-			{ attTiltAngle,     1, GL_FLOAT, offsetof(Star, tiltAngle) },
-			{ attSemiMajorAxis, 1, GL_FLOAT, offsetof(Star, a) },
-			{ attSemiMinorAxis, 1, GL_FLOAT, offsetof(Star, b) },
-			{ attTemperature,   1, GL_FLOAT, offsetof(Star, temp) },
-			{ attMagnitude,     1, GL_FLOAT, offsetof(Star, mag) },
-			{ attType,          1, GL_INT, offsetof(Star, type) },
-			{ attColor,         4, GL_FLOAT, offsetof(VertexStar, col) }
+			{ attVelTheta,  1, GL_FLOAT,          0, false, stVelocity },
+			{ attThetaType, 1, GL_UNSIGNED_SHORT, 0, false, stLook },
+			{ attColorIdx,  1, GL_UNSIGNED_BYTE,  2, false, stLook },
+			{ attMagnitude, 1, GL_UNSIGNED_BYTE,  3, true,  stLook },
+			{ attAxes,      2, GL_HALF_FLOAT,     0, false, stAxes },
+			{ attTilt,      2, GL_SHORT,          0, true,  stTilt }
 		});
 	}
 
+	/// Writes the words of vert selected by streamMask as vertex idx of the
+	/// streams mapped by FillStreams.
+	static void WriteVertex(void* const* mem, uint32_t streamMask, std::size_t idx, const VertexStar& vert)
+	{
+		const char* src = reinterpret_cast<const char*>(&vert);
+		for (int stream = 0; stream < NumStreams; ++stream)
+		{
+			if (streamMask & (1u << stream))
+				std::memcpy(static_cast<char*>(mem[stream]) + 4 * idx, src + 4 * stream, 4);
+		}
+	}
+
+	virtual void Initialize() override
+	{
+		VertexBufferBase::Initialize();
+
+		// The generic program of the base class is the one of the stars
+		// (PARTICLE_CLASS defaults to pcStars in the shaders)
+		_programs[pcStars] = GetShaderProgramm();
+		for (int cls = pcStars + 1; cls < NumParticleClasses; ++cls)
+			_programs[cls] = CreateProgram("#define PARTICLE_CLASS " + std::to_string(cls) + "\n");
+
+		_dustGridProgram = CreateProgram("#define PARTICLE_CLASS 1\n#define DUST_GRID\n");
+
+		for (GLuint program : _programs)
+			SetupProgram(program);
+
+		SetupProgram(_dustGridProgram);
+
+		glGenBuffers(1, &_paramBuffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, _paramBuffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(StarParams), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		_paramsUploaded = false;
+		CHECK_GL_ERROR
+	}
+
+	/// \param displayFeatures bit i set = draw particle class i
 	void UpdateShaderVariables(float time, int num, float amp, int dustSize, int displayFeatures)
 	{
 		_pertN = num;
@@ -64,6 +307,98 @@ public:
 		_h2 = params;
 	}
 
+	/// The excentricity and tilt profile of the galaxy. The shader samples
+	/// the table of the CPU, so both see exactly the same density waves.
+	void SetRadialProfile(const RadialProfile& profile)
+	{
+		if (_profileTexture != 0 && profile.GetVersion() == _profileVersion)
+			return;
+
+		if (_profileTexture == 0)
+		{
+			glGenTextures(1, &_profileTexture);
+			glBindTexture(GL_TEXTURE_1D, _profileTexture);
+			glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		}
+		else
+		{
+			glBindTexture(GL_TEXTURE_1D, _profileTexture);
+		}
+
+		static_assert(RadialProfile::NumChannels == 3, "the profile texture is RGB");
+		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB32F, RadialProfile::NumSamples, 0, GL_RGB, GL_FLOAT, profile.GetTable());
+		glBindTexture(GL_TEXTURE_1D, 0);
+		CHECK_GL_ERROR
+
+		_profileVersion = profile.GetVersion();
+		_profileScale = (RadialProfile::NumSamples - 1) / profile.GetMaxRadius();
+	}
+
+	virtual void Release() override
+	{
+		if (_profileTexture != 0)
+		{
+			glDeleteTextures(1, &_profileTexture);
+			_profileTexture = 0;
+		}
+
+		if (_colorTexture != 0)
+		{
+			glDeleteTextures(1, &_colorTexture);
+			_colorTexture = 0;
+		}
+
+		if (_paramBuffer != 0)
+		{
+			glDeleteBuffers(1, &_paramBuffer);
+			_paramBuffer = 0;
+		}
+
+		for (int cls = pcStars + 1; cls < NumParticleClasses; ++cls)
+		{
+			if (_programs[cls] != 0)
+			{
+				GlState::ForgetProgram(_programs[cls]);
+				glDeleteProgram(_programs[cls]);
+			}
+			_programs[cls] = 0;
+		}
+
+		if (_crowdingTexture != 0)
+		{
+			glDeleteTextures(1, &_crowdingTexture);
+			_crowdingTexture = 0;
+		}
+
+		if (_crowdingFbo != 0)
+		{
+			glDeleteFramebuffers(1, &_crowdingFbo);
+			_crowdingFbo = 0;
+		}
+
+		if (_crowdingVao != 0)
+		{
+			glDeleteVertexArrays(1, &_crowdingVao);
+			_crowdingVao = 0;
+		}
+
+		_crowdingKey = {};
+
+		for (GLuint* program : { &_dustGridProgram, &_crowdingProgram, &_splatPrograms[pcStars], &_splatPrograms[pcDust], &_splatPrograms[pcFilaments] })
+		{
+			if (*program != 0)
+			{
+				GlState::ForgetProgram(*program);
+				glDeleteProgram(*program);
+				*program = 0;
+			}
+		}
+
+		VertexBufferBase::Release();
+	}
+
 	/// Scales all point sizes. Needed to keep the relative sizes of stars and
 	/// dust intact when rendering into an offscreen buffer with a resolution
 	/// different from the window (i.e. when recording video).
@@ -72,23 +407,211 @@ public:
 		_sizeFactor = sizeFactor;
 	}
 
+	float GetSizeFactor() const
+	{
+		return _sizeFactor;
+	}
+
+	/** \brief Draws each dust particle as a single pixel carrying the light of
+		its sprite instead of the sprite itself.
+
+		Summed up in a coarse grid and blurred (see LowResLayer::Blur) this
+		gives the glow of the sprites at a fraction of their fill rate. The
+		point sizes must be scaled to the grid (see SetSizeFactor).
+	*/
+	void SetDustGrid(bool enable)
+	{
+		_dustGrid = enable;
+	}
+
+	/// Scales the brightness of stars and dust. Compensates for a population
+	/// that holds only a fraction of the particles (interactive preview).
+	void SetBrightnessGain(float gain)
+	{
+		_brightnessGain = gain;
+	}
+
+	/// The vertices of particle class cls are the count vertices starting at
+	/// first (see Galaxy::Layout). A level of detail draws the fraction
+	/// detail of them.
+	void SetClassRange(ParticleClass cls, GLint first, GLsizei count, float detail = 1)
+	{
+		_classFirst[cls] = first;
+		_classCount[cls] = count;
+		_classDetail[cls] = std::clamp(detail, 0.0f, 1.0f);
+	}
+
+	/// The radial shells of class cls in the draw order of the buffer. They
+	/// are used as long as the draw order is (see HasDrawOrder).
+	void SetShells(ParticleClass cls, const Shells& shells)
+	{
+		_shells[cls] = shells;
+	}
+
+	/// Particles whose orbit stays farther than radius (pc) from the center
+	/// are outside the view and not drawn; a negative radius draws all.
+	/// Needs the radial shells.
+	void SetCullRadius(float radius)
+	{
+		_cullRadius = radius;
+	}
+
 	virtual void Draw(glm::mat4& matView, glm::mat4& matProjection)
 	{
+		if (_classCount[pcH2] > 0 && (_displayFeatures & (1 << pcH2)) != 0)
+			UpdateCrowding(matView, matProjection);
+
+		BeginDraw(matView, matProjection);
+
+		// Switched off classes cost nothing
+		for (int cls = 0; cls < NumParticleClasses; ++cls)
+		{
+			if (_classCount[cls] <= 0 || (_displayFeatures & (1 << cls)) == 0)
+				continue;
+
+			GlState::UseProgram((cls == pcDust && _dustGrid) ? _dustGridProgram : _programs[cls]);
+			if (cls == pcH2)
+			{
+				glActiveTexture(GL_TEXTURE2);
+				glBindTexture(GL_TEXTURE_2D, _crowdingTexture);
+				glActiveTexture(GL_TEXTURE0);
+			}
+
+			if (HasDrawOrder())
+			{
+				SelectShells((ParticleClass)cls);
+				DrawRanges(_drawFirst, _drawCount);
+			}
+			else
+			{
+				DrawRange(_classFirst[cls], (GLsizei)std::ceil(_classCount[cls] * _classDetail[cls]));
+			}
+		}
+
 		CHECK_GL_ERROR
-		glUseProgram(GetShaderProgramm());
+	}
 
-		GLuint viewMatIdx = glGetUniformLocation(GetShaderProgramm(), "viewMat");
-		glUniformMatrix4fv(viewMatIdx, 1, GL_FALSE, glm::value_ptr(matView));
+	/** \brief Draws all particles of the classes set in the mask classes into
+		the ring texture bound by RingRenderer::BeginSplat.
 
-		GLuint projMatIdx = glGetUniformLocation(GetShaderProgramm(), "projMat");
-		glUniformMatrix4fv(projMatIdx, 1, GL_FALSE, glm::value_ptr(matProjection));
+		Each particle adds the light of its sprite at size factor 1 to the
+		texel of its orbit radius and initial angle; the dust size and the
+		brightness gain are left to RingRenderer::Draw. H2 regions cannot be
+		splatted, whether they shine depends on their current position.
+	*/
+	void Splat(int classes)
+	{
+		glm::mat4 identity(1.0f);
+		BeginDraw(identity, identity);
+
+		for (int cls = pcStars; cls < pcH2; ++cls)
+		{
+			if (_classCount[cls] <= 0 || (classes & (1 << cls)) == 0)
+				continue;
+
+			if (_splatPrograms[cls] == 0)
+			{
+				_splatPrograms[cls] = CreateProgram(
+					"#define PARTICLE_CLASS " + std::to_string(cls) + "\n"
+					"#define RING_SPLAT\n"
+					"#define RING_ANGLES " + std::to_string(RingRenderer::NumAngles) + "\n");
+				SetupProgram(_splatPrograms[cls]);
+			}
 
-		OnSetCustomShaderVariables();
+			GlState::UseProgram(_splatPrograms[cls]);
+			DrawRange(_classFirst[cls], _classCount[cls]);
+		}
+
+		CHECK_GL_ERROR
+	}
+
+private:
+
+	/** \brief Computes the orbit crowding of the H2 regions into
+		_crowdingTexture unless it is up to date.
+
+		Whether an H2 region shines depends on how close the neighbouring
+		density waves are at its current position. That is a function of the
+		orbit radius and the phase on the orbit only, so it is tabulated
+		over both once for the radial profile and perturbation instead of
+		being evaluated by every region in every frame. Column j of the
+		table is the parametric angle j / CrowdingPhases turns, row i the
+		radius of profile entry i; the H2 shader samples it bilinearly.
+	*/
+	void UpdateCrowding(glm::mat4& matView, glm::mat4& matProjection)
+	{
+		const CrowdingKey key = { _profileVersion, _pertN, _pertAmp };
+		if (_crowdingTexture != 0 && key == _crowdingKey)
+			return;
+
+		GLint prevFbo = 0;
+		GLint prevViewport[4] = {};
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &prevFbo);
+		glGetIntegerv(GL_VIEWPORT, prevViewport);
+
+		if (_crowdingTexture == 0)
+		{
+			glGenTextures(1, &_crowdingTexture);
+			glBindTexture(GL_TEXTURE_2D, _crowdingTexture);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, CrowdingPhases, RadialProfile::NumSamples, 0, GL_RED, GL_FLOAT, nullptr);
+			glBindTexture(GL_TEXTURE_2D, 0);
+
+			glGenFramebuffers(1, &_crowdingFbo);
+			glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _crowdingFbo);
+			glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, _crowdingTexture, 0);
+			if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			{
+				glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)prevFbo);
+				throw std::runtime_error("VertexBufferStars: crowding framebuffer is incomplete");
+			}
+
+			// The table vertices have no attributes; an empty array object
+			// keeps the disabled arrays of the buffer out of the draw.
+			glGenVertexArrays(1, &_crowdingVao);
+		}
+
+		if (_crowdingProgram == 0)
+		{
+			_crowdingProgram = CreateProgram(
+				"#define PARTICLE_CLASS 3\n"
+				"#define H2_CROWDING\n"
+				"#define CROWDING_PHASES " + std::to_string(CrowdingPhases) + "\n");
+			SetupProgram(_crowdingProgram);
+		}
+
+		BeginDraw(matView, matProjection);
+		GlState::Disable(GL_BLEND);
+		GlState::UseProgram(_crowdingProgram);
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _crowdingFbo);
+		glViewport(0, 0, CrowdingPhases, RadialProfile::NumSamples);
+		glBindVertexArray(_crowdingVao);
+		glDrawArrays(GL_POINTS, 0, CrowdingPhases * RadialProfile::NumSamples);
+		glBindVertexArray(0);
+
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, (GLuint)prevFbo);
+		glViewport(prevViewport[0], prevViewport[1], prevViewport[2], prevViewport[3]);
+		CHECK_GL_ERROR
+
+		_crowdingKey = key;
+	}
+
+	/// Sets the state, uniforms and textures all programs draw with
+	void BeginDraw(glm::mat4& matView, glm::mat4& matProjection)
+	{
+		CHECK_GL_ERROR
+		if (_colorTexture == 0)
+			CreateColorTexture();
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, _blendFunc);
-		glBlendEquation(_blendEquation);
-		glEnable(GL_PROGRAM_POINT_SIZE);
+		GlState::Enable(GL_BLEND);
+		GlState::BlendFunc(GL_SRC_ALPHA, _blendFunc);
+		GlState::BlendEquation(_blendEquation);
+		GlState::Enable(GL_PROGRAM_POINT_SIZE);
+		GlState::Disable(GL_PRIMITIVE_RESTART);
 		// Enable point sprite coordinate replacement so gl_PointCoord is provided
 		// in the fragment shader. Officially GL_POINT_SPRITE does not exist in
 		// core profiles (coord replacement is always on there), but some drivers
@@ -98,27 +621,39 @@ public:
 		// (e.g. WGL under Wine/Windows) instead reject the enum with
 		// GL_INVALID_ENUM, which CHECK_GL_ERROR would escalate to a fatal error.
 		// So probe once: try the enable and remember whether the driver takes it.
+		// The expected error is kept out of the debug output (see GlDebug).
 		static const bool usePointSprite = []() {
 			while (glGetError() != GL_NO_ERROR) {}  // drain pending errors
+			GlDebug::Mute();
 			glEnable(GL_POINT_SPRITE);
-			return glGetError() == GL_NO_ERROR;
+			const bool ok = glGetError() == GL_NO_ERROR;
+			GlDebug::Unmute();
+			if (ok)
+				glDisable(GL_POINT_SPRITE);   // GlState sets it from now on
+			return ok;
 		}();
 		if (usePointSprite)
-			glEnable(GL_POINT_SPRITE);
+			GlState::Enable(GL_POINT_SPRITE);
 		OnBeforeDraw();
 
-		glBindVertexArray(GetVertexArrayObject());
-		glDrawElements(GetPrimitiveType(), GetArrayElementCount(), GL_UNSIGNED_INT, nullptr);
-		glBindVertexArray(0);
+		UploadParams(matView, matProjection);
+		glBindBufferBase(GL_UNIFORM_BUFFER, ParamBinding, _paramBuffer);
 
-		if (usePointSprite)
-			glDisable(GL_POINT_SPRITE);
-		glDisable(GL_PROGRAM_POINT_SIZE);
-		glDisable(GL_BLEND);
-		glBlendEquation(GL_FUNC_ADD);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_1D, _profileTexture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_1D, _colorTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
 
-		glUseProgram(0);
-		CHECK_GL_ERROR
+	/// All programs read the same uniform block; the samplers never change
+	void SetupProgram(GLuint program)
+	{
+		glUniformBlockBinding(program, glGetUniformBlockIndex(program, "StarParams"), ParamBinding);
+		GlState::UseProgram(program);
+		glUniform1i(glGetUniformLocation(program, "radialProfile"), 0);
+		glUniform1i(glGetUniformLocation(program, "colorTable"), 1);
+		glUniform1i(glGetUniformLocation(program, "crowdingTable"), 2);
 	}
 
 protected:
@@ -127,49 +662,49 @@ protected:
 	{
 		return
 			"#version 330 core\n"
+			"#ifndef PARTICLE_CLASS\n"
+			"#define PARTICLE_CLASS 0\n"
+			"#endif\n"
 			"#define DEG_TO_RAD 0.01745329251\n"
 			"\n"
-			"uniform mat4 projMat;\n"
-			"uniform mat4 viewMat;\n"
-			"uniform int pertN;\n"
-			"uniform int dustSize;\n"
-			"uniform int displayFeatures;\n"
-			"uniform float pertAmp;\n"
-			"uniform float time;\n"
-			"uniform float sizeFactor;\n"
-			"uniform float radCore;\n"
-			"uniform float radGalaxy;\n"
-			"uniform float radFarField;\n"
-			"uniform float exInner;\n"
-			"uniform float exOuter;\n"
-			"uniform float angleOffset;\n"
-			"uniform float h2SizeMax;\n"
-			"uniform float h2Threshold;\n"
-			"uniform float barRadius;\n"   // 0 = no bar
-			"uniform float barEx;\n"
+			"// VertexBufferStars::StarParams\n"
+			"layout(std140) uniform StarParams {\n"
+			"	mat4 projMat;\n"
+			"	mat4 viewMat;\n"
+			"	float time;\n"
+			"	float pertAmp;\n"
+			"	float sizeFactor;\n"
+			"	float brightnessGain;\n"
+			"	float h2SizeMax;\n"
+			"	float h2Threshold;\n"
+			"	float barRadius;\n"      // 0 = no bar
+			"	float profileScale;\n"   // table entries per parsec
+			"	int pertN;\n"
+			"	int dustSize;\n"
+			"};\n"
+			"uniform sampler1D radialProfile;\n"
+			"uniform sampler1D colorTable;\n"
+			"#if PARTICLE_CLASS == 3 && !defined(H2_CROWDING)\n"
+			"uniform sampler2D crowdingTable;\n"
+			"#endif\n"
 			"\n"
-			"layout(location = 0) in float theta0;\n"
-			"layout(location = 1) in float velTheta;\n"
-			"layout(location = 2) in float tiltAngle;\n"
-			"layout(location = 3) in float a;\n"
-			"layout(location = 4) in float b;\n"
-			"layout(location = 5) in float temp;\n"
-			"layout(location = 6) in float mag;\n"
-			"layout(location = 7) in int type;\n"
-			"layout(location = 8) in vec4 color;\n"
+			"// The packed VertexStar\n"
+			"layout(location = 0) in float velTheta;\n"
+			"layout(location = 1) in uint thetaType;\n"
+			"layout(location = 2) in vec2 axes;\n"
+			"layout(location = 3) in vec2 tilt;\n"     // cos and sin of the tilt angle
+			"layout(location = 4) in uint colorIdx;\n"
+			"layout(location = 5) in float magSqrt;\n"
 			"\n"
 			"out vec4 vertexColor;\n"
-			"flat out int vertexType;\n"
-			"flat out int features;\n"
 			"\n"
-			"vec2 calcPos(float a, float b, float theta, float velTheta, float time, float tiltAngle) {\n"
+			"vec2 calcPos(float a, float b, float theta, float velTheta, float time, vec2 tilt) {\n"
 			"	float thetaActual = theta + velTheta * time;\n"
-			"	float beta = -tiltAngle;\n"
 			"	float alpha = thetaActual * DEG_TO_RAD;\n"
 			"	float cosalpha = cos(alpha);\n"
 			"	float sinalpha = sin(alpha);\n"
-			"	float cosbeta = cos(beta);\n"
-			"	float sinbeta = sin(beta);\n"
+			"	float cosbeta = tilt.x;\n"
+			"	float sinbeta = -tilt.y;\n"
 			"	vec2 center = vec2(0,0);\n"
 			"	vec2 ps = vec2(center.x + (a * cosalpha * cosbeta - b * sinalpha * sinbeta),\n"
 			"			       center.y + (a * cosalpha * sinbeta + b * sinalpha * cosbeta));\n"
@@ -180,29 +715,16 @@ protected:
 			"	return ps;\n"
 			"}\n"
 			"\n"
-			"// Excentricity of the density wave at radius r. Mirrors\n"
-			"// Galaxy::GetExcentricity (incl. the bar profile) - keep in lockstep.\n"
-			"float excentricity(float r) {\n"
-			"	if (r < radCore) {\n"
-			"		if (barRadius > 0.0) {\n"
-			"			if (r < barRadius)\n"
-			"				return 1.0 + (r / barRadius) * (barEx - 1.0);\n"
-			"			return barEx + (r - barRadius) / (radCore - barRadius) * (exInner - barEx);\n"
-			"		}\n"
-			"		return 1.0 + (r / radCore) * (exInner - 1.0);\n"
-			"	}\n"
-			"	else if (r <= radGalaxy)\n"
-			"		return exInner + (r - radCore) / (radGalaxy - radCore) * (exOuter - exInner);\n"
-			"	else if (r < radFarField)\n"
-			"		return exOuter + (r - radGalaxy) / (radFarField - radGalaxy) * (1.0 - exOuter);\n"
-			"	else\n"
-			"		return 1.0;\n"
-			"}\n"
-			"\n"
-			"// Ellipse tilt at radius r. Mirrors Galaxy::GetAngularOffset(r):\n"
-			"// inside the bar all orbits share the bar-end orientation.\n"
-			"float tiltAt(float r) {\n"
-			"	return ((barRadius > 0.0) ? max(r, barRadius) : r) * angleOffset;\n"
+			"// Radial profile of the galaxy at radius r: x = excentricity,\n"
+			"// y = tilt. The table of the CPU (RadialProfile::Eval), interpolated\n"
+			"// the same way.\n"
+			"vec2 profileAt(float r) {\n"
+			"	int last = textureSize(radialProfile, 0) - 1;\n"
+			"	float x = clamp(r * profileScale, 0.0, float(last));\n"
+			"	int idx = min(int(x), last - 1);\n"
+			"	vec2 v0 = texelFetch(radialProfile, idx, 0).xy;\n"
+			"	vec2 v1 = texelFetch(radialProfile, idx + 1, 0).xy;\n"
+			"	return v0 + (x - float(idx)) * (v1 - v0);\n"
 			"}\n"
 			"\n"
 			"// Suppression of star formation inside the bar body (bars are old and\n"
@@ -212,144 +734,254 @@ protected:
 			"	return (barRadius > 0.0) ? smoothstep(0.6 * barRadius, 1.05 * barRadius, r) : 1.0;\n"
 			"}\n"
 			"\n"
+			"#if defined(H2_CROWDING)\n"
+			"// Orbit crowding at parametric angle theta (deg) of the orbit of\n"
+			"// semi-major axis a: measure the radial gap to the neighbouring density\n"
+			"// waves at a +/- delta, each with its own excentricity and tilt. The\n"
+			"// parametric angle is shifted by the tilt difference so both points\n"
+			"// lie at the same polar angle; the distance is then the true wave\n"
+			"// spacing. Where waves converge (arm crest) the region ignites.\n"
+			"float crowding(float a, float theta) {\n"
+			"	vec2 prof = profileAt(a);\n"
+			"	vec2 ps = calcPos(a, a * prof.x, theta, 0.0, 0.0, vec2(cos(prof.y), sin(prof.y)));\n"
+			"	float delta = 1000.0;\n"
+			"	float aI = max(a - delta, 0.0);\n"
+			"	float dI = a - aI;\n"
+			"	float aO = a + delta;\n"
+			"	vec2 profI = profileAt(aI);\n"
+			"	vec2 profO = profileAt(aO);\n"
+			"	float tA = prof.y;\n"
+			"	float tI = profI.y;\n"
+			"	float tO = profO.y;\n"
+			"	vec2 psI = calcPos(aI, aI * profI.x, theta - (tA - tI) / DEG_TO_RAD, 0.0, 0.0, vec2(cos(tI), sin(tI)));\n"
+			"	vec2 psO = calcPos(aO, aO * profO.x, theta + (tO - tA) / DEG_TO_RAD, 0.0, 0.0, vec2(cos(tO), sin(tO)));\n"
+			"	return 0.5 * (dI / max(distance(ps, psI), 1.0) + delta / max(distance(ps, psO), 1.0));\n"
+			"}\n"
+			"\n"
+			"// Computes texel gl_VertexID of the crowding table (see\n"
+			"// VertexBufferStars::UpdateCrowding): column j is the parametric angle\n"
+			"// j / CROWDING_PHASES turns, row i the radius of profile entry i.\n"
 			"void main()\n"
 			"{\n"
-			"	vec2 ps = calcPos(a, b, theta0, velTheta, time, tiltAngle);"
+			"	ivec2 size = ivec2(CROWDING_PHASES, textureSize(radialProfile, 0));\n"
+			"	ivec2 texel = ivec2(gl_VertexID % size.x, gl_VertexID / size.x);\n"
+			"	float rho = crowding(float(texel.y) / profileScale, float(texel.x) * (360.0 / float(CROWDING_PHASES)));\n"
+			"	vertexColor = vec4(rho, 0.0, 0.0, 1.0);\n"
+			"	gl_Position = vec4((vec2(texel) + 0.5) / vec2(size) * 2.0 - 1.0, 0, 1);\n"
+			"	gl_PointSize = 1.0;\n"
+			"}\n"
+			"#else\n"
+			"void main()\n"
+			"{\n"
+			"	int type = int(thetaType & 7u);\n"
+			"	float theta0 = float(thetaType >> 3) * (360.0 / 8192.0);\n"
+			"	float a = axes.x * 1000.0;\n"
+			"	float b = axes.y * 1000.0;\n"
+			"	float mag = magSqrt * magSqrt;\n"
+			"	vec4 color = vec4(texelFetch(colorTable, int(colorIdx), 0).rgb, 1.0);\n"
+			"	vec2 ps = calcPos(a, b, theta0, velTheta, time, tilt);\n"
+			"\n"
+			"#if PARTICLE_CLASS == 0\n"
+			"	gl_PointSize = mag * 4.0;\n"
+			"	vertexColor = color * mag;\n"
+			"#elif PARTICLE_CLASS == 1\n"
+			"	gl_PointSize = mag * 5.0 * float(dustSize);\n"
+			"	vertexColor = color * mag;\n"
+			"#elif PARTICLE_CLASS == 2\n"
+			"	gl_PointSize = mag * 2.0 * float(dustSize);\n"
+			"	vertexColor = color * mag;\n"
+			"#else\n"
+			"	// Orbit crowding depends on the orbit and the phase on it only; it\n"
+			"	// is looked up in the table of the H2_CROWDING program.\n"
+			"	vec2 tableSize = vec2(textureSize(crowdingTable, 0));\n"
+			"	float phase = fract((theta0 + velTheta * time) / 360.0);\n"
+			"	float rho = texture(crowdingTable, vec2(phase + 0.5 / tableSize.x, (a * profileScale + 0.5) / tableSize.y)).r;\n"
+			"	// Ignition is suppressed inside the bar body: bars are old and\n"
+			"	// gas-poor except at their ends.\n"
+			"	float ignite = smoothstep(h2Threshold, 1.5 * h2Threshold, rho) * barFactor(a);\n"
+			"	if (type==3) {\n"
+			"		gl_PointSize = h2SizeMax * ignite;\n"
+			"		vertexColor = color * mag * vec4(2.0, 0.5, 0.5, 1.0) * ignite;\n"
+			"	} else {\n"
+			"		gl_PointSize = h2SizeMax * ignite / 10.0;\n"
+			"		vertexColor = vec4(1,1,1,1) * ignite;\n"
+			"	}\n"
+			"#endif\n"
 			"\n"
-			"	if (type==0) {\n"
-			"		gl_PointSize = mag * 4.0;\n"
-			"	    vertexColor = color * mag ;\n"
-			"	} else if (type==1) {\n"
-			"		gl_PointSize = mag * 5.0 * float(dustSize);\n"
-			"	    vertexColor = color * mag;\n"
-			"	} else if (type==2) {\n"
-			"		gl_PointSize = mag * 2.0 * float(dustSize);\n"
-			"	    vertexColor = color * mag;\n"
-			"	} else if (type==3 || type==4) {\n"
-			"		// Orbit crowding: measure the radial gap to the neighbouring density\n"
-			"		// waves at a +/- delta, each with its own excentricity and tilt. The\n"
-			"		// parametric angle is shifted by the tilt difference so both points\n"
-			"		// lie at the same polar angle; the distance is then the true wave\n"
-			"		// spacing. Where waves converge (arm crest) the region ignites.\n"
-			"		float delta = 1000.0;\n"
-			"		float aI = max(a - delta, 0.0);\n"
-			"		float dI = a - aI;\n"
-			"		float aO = a + delta;\n"
-			"		float tA = tiltAt(a);\n"
-			"		float tI = tiltAt(aI);\n"
-			"		float tO = tiltAt(aO);\n"
-			"		vec2 psI = calcPos(aI, aI * excentricity(aI), theta0 - (tA - tI) / DEG_TO_RAD, velTheta, time, tI);\n"
-			"		vec2 psO = calcPos(aO, aO * excentricity(aO), theta0 + (tO - tA) / DEG_TO_RAD, velTheta, time, tO);\n"
-			"		float rho = 0.5 * (dI / max(distance(ps, psI), 1.0) + delta / max(distance(ps, psO), 1.0));\n"
-			"		// Ignition is suppressed inside the bar body: bars are old and\n"
-			"		// gas-poor except at their ends.\n"
-			"		float ignite = smoothstep(h2Threshold, 1.5 * h2Threshold, rho) * barFactor(a);\n"
-			"		if (type==3) {\n"
-			"			gl_PointSize = h2SizeMax * ignite;\n"
-			"			vertexColor = color * mag * vec4(2.0, 0.5, 0.5, 1.0) * ignite;\n"
-			"		} else {\n"
-			"			gl_PointSize = h2SizeMax * ignite / 10.0;\n"
-			"			vertexColor = vec4(1,1,1,1) * ignite;\n"
-			"		}\n"
-			"   }\n"
+			"#if PARTICLE_CLASS != 3 && !defined(RING_SPLAT)\n"
+			"	vertexColor.rgb *= brightnessGain;\n"
+			"#endif\n"
 			"	gl_Position =  projMat * vec4(ps, 0, 1);\n"
-			"   gl_PointSize = max(gl_PointSize * sizeFactor, 0.0);\n"
-			"	vertexType = type;\n"
-			"	features = displayFeatures;\n"
-			"}\n";
+			"#if defined(RING_SPLAT)\n"
+			"	// The texel of the ring of the orbit at the initial angle (see\n"
+			"	// RingRenderer); the light of the sprite as for DUST_GRID, but\n"
+			"	// without size factor and dust size\n"
+			"	float size = gl_PointSize / ((PARTICLE_CLASS == 0) ? 1.0 : float(dustSize));\n"
+			"	float peakAlpha = (PARTICLE_CLASS == 1) ? 0.05 : ((PARTICLE_CLASS == 2) ? 0.07 : 1.0);\n"
+			"	vertexColor.rgb *= peakAlpha * 3.14159265 / 12.0 * size * size;\n"
+			"	float radMax = float(textureSize(radialProfile, 0) - 1) / profileScale;\n"
+			"	float angle = theta0 / 360.0 * float(RING_ANGLES) + 0.5;\n"
+			"	gl_Position = vec4(2.0 * angle / float(RING_ANGLES) - 1.0, 2.0 * a / radMax - 1.0, 0, 1);\n"
+			"	gl_PointSize = 1.0;\n"
+			"#elif defined(DUST_GRID)\n"
+			"	// The light of the sprite: its area times the mean of its cone\n"
+			"	// shaped alpha (see the fragment shader), in one pixel\n"
+			"	float size = gl_PointSize * sizeFactor;\n"
+			"	vertexColor.rgb *= 0.05 * 3.14159265 / 12.0 * size * size;\n"
+			"	gl_PointSize = 1.0;\n"
+			"#else\n"
+			"	gl_PointSize = max(gl_PointSize * sizeFactor, 0.0);\n"
+			"#endif\n"
+			"}\n"
+			"#endif\n";
 	}
 
 	virtual const char* GetFragmentShaderSource() const override
 	{
 		return
 			"#version 330 core\n"
+			"#ifndef PARTICLE_CLASS\n"
+			"#define PARTICLE_CLASS 0\n"
+			"#endif\n"
 			"in vec4 vertexColor;\n"
-			"flat in int vertexType;\n"
-			"flat in int features;\n"
 			"out vec4 FragColor;\n"
 			"void main()\n"
 			"{\n"
-			"	if (vertexType==0) {\n"
-			"		if ( (features & 1) ==0)\n"
-			"			discard;\n"
-			"		vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
-			"		float alpha =1-length(circCoord);\n"
-			"		FragColor = vec4(vertexColor.xyz, alpha);\n"
-			"	} else if (vertexType==1) {\n"
-			"		if ( (features & 2) ==0)\n"
-			"			discard;\n"
-			"		vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
-			"		float alpha = 0.05 * (1-length(circCoord));\n"
-			"		FragColor = vec4(vertexColor.xyz, alpha);\n"
-			"	} else if (vertexType==2) {\n"
-			"		if ( (features & 4) ==0)\n"
-			"			discard;\n"
-			"		vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
-			"		float alpha = 0.07 * (1-length(circCoord));\n"
-			"		FragColor = vec4(vertexColor.xyz, alpha);\n"
-			"	} else if (vertexType==3) {\n"
-			"		if ((features & 8) == 0)\n"
-			"			discard;\n"
-			"		vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
-			"		float alpha = 1-length(circCoord);\n"
-			"		FragColor = vec4(vertexColor.xyz, alpha);\n"
-			"	} else if (vertexType==4) {\n"
-			"		if ((features & 8)== 0)\n"
-			"			discard;\n"
-			"		vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
-			"		float alpha = 1-length(circCoord);\n"
-			"		FragColor = vec4(vertexColor.xyz, alpha);\n"
-			"   }\n"
+			"	vec2 circCoord = 2.0 * gl_PointCoord - 1.0;\n"
+			"#if defined(DUST_GRID) || defined(RING_SPLAT) || defined(H2_CROWDING)\n"
+			"	float alpha = 1.0;\n"
+			"#elif PARTICLE_CLASS == 1\n"
+			"	float alpha = 0.05 * (1-length(circCoord));\n"
+			"#elif PARTICLE_CLASS == 2\n"
+			"	float alpha = 0.07 * (1-length(circCoord));\n"
+			"#else\n"
+			"	float alpha = 1-length(circCoord);\n"
+			"#endif\n"
+			"	FragColor = vec4(vertexColor.xyz, alpha);\n"
 			"}\n";
 	}
 
-	virtual void OnSetCustomShaderVariables() override
+private:
+
+	enum AttributeIdx : int
 	{
-		GLuint varDustSize = glGetUniformLocation(GetShaderProgramm(), "dustSize");
-		glUniform1i(varDustSize, _dustSize);
+		attVelTheta = 0,
+		attThetaType,
+		attAxes,
+		attTilt,
+		attColorIdx,
+		attMagnitude
+	};
+
+	/// The uniform block shared by all _programs, in std140 layout
+	struct StarParams
+	{
+		glm::mat4 projMat;
+		glm::mat4 viewMat;
+		float time;
+		float pertAmp;
+		float sizeFactor;
+		float brightnessGain;
+		float h2SizeMax;
+		float h2Threshold;
+		float barRadius;
+		float profileScale;
+		int32_t pertN;
+		int32_t dustSize;
+		int32_t pad[2];       ///< std140 rounds the block up to 16 bytes
+	};
 
-		GLuint varPertN = glGetUniformLocation(GetShaderProgramm(), "pertN");
-		glUniform1i(varPertN, _pertN);
+	static_assert(sizeof(StarParams) == 176 && offsetof(StarParams, time) == 128 && offsetof(StarParams, pertN) == 160,
+		"StarParams must match the std140 layout of the shader");
 
-		GLuint varPertAmp = glGetUniformLocation(GetShaderProgramm(), "pertAmp");
-		glUniform1f(varPertAmp, _pertAmp);
+	/// Binding point of the StarParams block
+	static constexpr GLuint ParamBinding = 0;
 
-		GLuint varTime = glGetUniformLocation(GetShaderProgramm(), "time");
-		glUniform1f(varTime, _time);
+	/// Angular resolution of the crowding table (see UpdateCrowding)
+	static constexpr int CrowdingPhases = 1024;
 
-		GLuint varDisplayFeatures = glGetUniformLocation(GetShaderProgramm(), "displayFeatures");
-		glUniform1i(varDisplayFeatures, _displayFeatures);
+	/// What the crowding table depends on besides the uniform block
+	struct CrowdingKey
+	{
+		unsigned profileVersion;
+		int pertN;
+		float pertAmp;
+
+		bool operator==(const CrowdingKey& other) const
+		{
+			return profileVersion == other.profileVersion && pertN == other.pertN && pertAmp == other.pertAmp;
+		}
+	};
+
+	/// Uploads the uniform block if one of its values changed
+	void UploadParams(const glm::mat4& matView, const glm::mat4& matProjection)
+	{
+		StarParams params = {};
+		params.projMat = matProjection;
+		params.viewMat = matView;
+		params.time = _time;
+		params.pertAmp = _pertAmp;
+		params.sizeFactor = _sizeFactor;
+		params.brightnessGain = _brightnessGain;
+		params.h2SizeMax = _h2.sizeMax;
+		params.h2Threshold = _h2.threshold;
+		params.barRadius = _h2.barRadius;
+		params.profileScale = _profileScale;
+		params.pertN = _pertN;
+		params.dustSize = _dustSize;
 
-		GLuint varSizeFactor = glGetUniformLocation(GetShaderProgramm(), "sizeFactor");
-		glUniform1f(varSizeFactor, _sizeFactor);
+		if (_paramsUploaded && std::memcmp(&params, &_params, sizeof(params)) == 0)
+			return;
 
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "radCore"), _h2.radCore);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "radGalaxy"), _h2.radGalaxy);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "radFarField"), _h2.radFarField);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "exInner"), _h2.exInner);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "exOuter"), _h2.exOuter);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "angleOffset"), _h2.angleOffset);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "h2SizeMax"), _h2.sizeMax);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "h2Threshold"), _h2.threshold);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "barRadius"), _h2.barRadius);
-		glUniform1f(glGetUniformLocation(GetShaderProgramm(), "barEx"), _h2.barEx);
+		glBindBuffer(GL_UNIFORM_BUFFER, _paramBuffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(params), &params);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		_params = params;
+		_paramsUploaded = true;
 	}
 
+	/// The element ranges of class cls to draw: the level of detail of each
+	/// shell that is not entirely outside the cull radius.
+	void SelectShells(ParticleClass cls)
+	{
+		const Shells& shells = _shells[cls];
+		const float detail = _classDetail[cls];
 
-private:
+		// The perturbation moves a particle by up to |a| / pertAmp off its
+		// ellipse; the GPU sees the axes rounded to half floats. Shells and
+		// maxA are built from the absolute semi-axes (see SortIntoShells).
+		const float marginPerA = ((_pertAmp > 0 && _pertN > 0) ? 1 / _pertAmp : 0) + 1e-3f;
 
-	enum AttributeIdx : int
+		_drawFirst.clear();
+		_drawCount.clear();
+		for (int s = 0; s < NumShells; ++s)
+		{
+			if (_cullRadius >= 0 && s * shells.width - marginPerA * shells.maxA[s] > _cullRadius)
+				continue;
+
+			const GLsizei count = (GLsizei)std::ceil(shells.count[s] * detail);
+			if (count > 0)
+			{
+				_drawFirst.push_back(shells.first[s]);
+				_drawCount.push_back(count);
+			}
+		}
+	}
+
+	/// Uploads Helper::ColorTable(), the colors VertexStar::colorIdx refers to
+	void CreateColorTexture()
 	{
-		attTheta0 = 0,
-		attVelTheta,
-		attTiltAngle,
-		attSemiMajorAxis,
-		attSemiMinorAxis,
-		attTemperature,
-		attMagnitude,
-		attType,
-		attColor
-	};
+		glGenTextures(1, &_colorTexture);
+		glBindTexture(GL_TEXTURE_1D, _colorTexture);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+
+		static_assert(sizeof(Color) == 4 * sizeof(float), "the color texture is RGBA32F");
+		glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA32F, Helper::ColorTableSize, 0, GL_RGBA, GL_FLOAT, Helper::ColorTable());
+		glBindTexture(GL_TEXTURE_1D, 0);
+		CHECK_GL_ERROR
+	}
 
 	// parameters for density wave computation
 	int _pertN;
@@ -360,5 +992,29 @@ private:
 	GLuint _blendEquation;
 	int _displayFeatures;
 	float _sizeFactor;
+	float _brightnessGain;
 	H2Params _h2 = {};
+	GLuint _profileTexture;            ///< RGB32F table of the RadialProfile
+	unsigned _profileVersion;          ///< RadialProfile::GetVersion() of the texture
+	float _profileScale;
+	GLuint _colorTexture;              ///< RGBA32F Helper::ColorTable()
+	GLuint _paramBuffer;               ///< uniform buffer of the StarParams block
+	StarParams _params;                ///< content of _paramBuffer
+	bool _paramsUploaded;              ///< _params is valid
+	GLuint _programs[NumParticleClasses];   ///< shader program per ParticleClass
+	GLuint _dustGridProgram;                ///< dust drawn for the density grid (see SetDustGrid)
+	GLuint _splatPrograms[NumParticleClasses];   ///< see Splat; created on first use
+	GLuint _crowdingProgram;                ///< computes _crowdingTexture; created on first use
+	GLuint _crowdingTexture;                ///< R32F orbit crowding of the H2 regions (see UpdateCrowding)
+	GLuint _crowdingFbo;
+	GLuint _crowdingVao;                    ///< empty; the table texels are computed from their index
+	CrowdingKey _crowdingKey;               ///< state _crowdingTexture was computed for
+	bool _dustGrid;
+	GLint _classFirst[NumParticleClasses];  ///< see SetClassRange
+	GLsizei _classCount[NumParticleClasses];
+	float _classDetail[NumParticleClasses];  ///< level of detail of each class
+	Shells _shells[NumParticleClasses];     ///< see SetShells
+	float _cullRadius;                      ///< see SetCullRadius
+	std::vector<GLint> _drawFirst;          ///< element ranges of SelectShells
+	std::vector<GLsizei> _drawCount;
 };
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/** \brief A small pool of persistent worker threads.
+
+	Work is submitted as a number of independent tasks that are handed out to
+	the workers (and the calling thread) one at a time. The pool does not
+	define how work is split: callers that need results independent of the
+	thread count must split their work into a fixed number of tasks.
+*/
+class WorkerPool final
+{
+public:
+	/// \param numThreads total number of threads working on a ParallelFor,
+	///        including the calling thread; 0 = one per hardware thread.
+	explicit WorkerPool(int numThreads = 0);
+	~WorkerPool();
+
+	int GetNumThreads() const noexcept;
+
+	/// Runs task(0) ... task(numTasks - 1) and returns when all of them are
+	/// finished. The first exception thrown by a task is rethrown here.
+	/// Concurrent calls from different threads are serialized.
+	void ParallelFor(int numTasks, const std::function<void(int)>& task);
+
+private:
+
+	WorkerPool(const WorkerPool& obj);
+	WorkerPool& operator=(const WorkerPool& obj);
+
+	void WorkerMain();
+	void RunTasks();
+
+	std::vector<std::thread> _threads;
+
+	std::mutex _callMutex;          ///< serializes ParallelFor calls
+	std::mutex _mutex;              ///< guards the job state below
+	std::condition_variable _cvWork;
+	std::condition_variable _cvDone;
+
+	const std::function<void(int)>* _task;
+	int _numTasks;
+	std::atomic<int> _nextTask;
+	int _busyWorkers;
+	unsigned _jobId;                ///< incremented for every ParallelFor
+	bool _shutdown;
+
+	std::exception_ptr _error;
+};
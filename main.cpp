@@ -13,6 +13,7 @@ static void PrintUsage()
 		<< "Options:\n"
 		<< "  --video-size WxH   Resolution of the exported video (default: 3840x2160)\n"
 		<< "  --video-fps N      Frame rate of the exported video (default: 60)\n"
+		<< "  --threads N        Threads used for building the galaxy (default: all cores)\n"
 		<< "  --help             Show this help\n"
 		<< "\n"
 		<< "Press [F7] in the application to start/stop the video recording.\n"
@@ -24,6 +25,7 @@ int main(int argc, char** argv)
 	int videoWidth = 3840;
 	int videoHeight = 2160;
 	int videoFps = 60;
+	int numThreads = 0;
 
 	for (int i = 1; i < argc; ++i)
 	{
@@ -49,6 +51,15 @@ int main(int argc, char** argv)
 				return 1;
 			}
 		}
+		else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			numThreads = std::atoi(argv[++i]);
+			if (numThreads < 1)
+			{
+				std::cout << "Invalid argument for --threads" << std::endl;
+				return 1;
+			}
+		}
 		else
 		{
 			std::cout << "Unknown option: " << argv[i] << std::endl;
@@ -61,6 +72,8 @@ int main(int argc, char** argv)
 	{
 		GalaxyWnd wndMain;
 		wndMain.SetVideoOptions(videoWidth, videoHeight, videoFps);
+		if (numThreads > 0)
+			wndMain.SetNumThreads(numThreads);
 		wndMain.Init(1500, 1000, 35000.0, "Rendering a Galaxy with Density Waves");
 		wndMain.MainLoop();
 	}
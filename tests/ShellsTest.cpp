@@ -0,0 +1,106 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "Galaxy.hpp"
+#include "VertexBufferStars.hpp"
+
+
+namespace
+{
+	int failures = 0;
+
+	void Check(bool condition, const char* what, int population, int cls)
+	{
+		if (condition)
+			return;
+
+		std::printf("population %d, class %d: %s\n", population, cls, what);
+		++failures;
+	}
+}
+
+
+/** \brief Sorts filament heavy populations into radial shells (see
+	VertexBufferStars::SortIntoShells) and checks that every shell index and
+	draw order entry stays in range.
+
+	The random walk of the filaments gives some of their particles negative
+	semi-axes; they must land in the innermost shells instead of writing
+	before the shell arrays.
+*/
+int main()
+{
+	Galaxy galaxy;
+	int numNegative = 0;
+
+	for (int population = 0; population < 8; ++population)
+	{
+		Galaxy::GalaxyParam param = {};
+		param.rad = 13000 + 1000 * population;
+		param.radCore = 4000;
+		param.deltaAng = 0.0004f;
+		param.ex1 = 0.9f;
+		param.ex2 = 0.9f;
+		param.numStars = 1000;
+		param.hasDarkMatter = true;
+		param.pertN = 2;
+		param.pertAmp = 40;
+		param.dustRenderSize = 70;
+		param.baseTemp = 4000;
+		param.numDust = 100000;    // one filament per 100 dust clouds
+		param.numH2 = 100;
+		galaxy.Reset(param);
+		galaxy.Update();
+
+		const std::vector<Star>& stars = galaxy.GetStars();
+		const Galaxy::Layout& layout = galaxy.GetLayout();
+		const std::size_t classSize[] = { layout.numStars, layout.numDust, layout.numFilaments, layout.numH2 };
+
+		std::vector<GLuint> order(stars.size());
+		std::size_t first = 0;
+		for (int cls = 0; cls < VertexBufferStars::NumParticleClasses; ++cls)
+		{
+			for (std::size_t i = first; i < first + classSize[cls]; ++i)
+				numNegative += (stars[i].a < 0 || stars[i].b < 0) ? 1 : 0;
+
+			VertexBufferStars::Shells shells;
+			VertexBufferStars::SortIntoShells(stars.data(), first, classSize[cls], order.data(), shells);
+
+			// The shells partition the range of the class
+			GLint pos = (GLint)first;
+			for (int s = 0; s < VertexBufferStars::NumShells; ++s)
+			{
+				Check(shells.first[s] == pos && shells.count[s] >= 0, "shells do not partition the class", population, cls);
+				Check(shells.maxA[s] >= 0, "negative maxA", population, cls);
+				pos += shells.count[s];
+			}
+			Check(pos == (GLint)(first + classSize[cls]), "shell counts do not add up", population, cls);
+
+			// The order of the class is a permutation of its indices
+			std::vector<bool> seen(classSize[cls], false);
+			bool permutation = true;
+			for (std::size_t i = first; i < first + classSize[cls]; ++i)
+			{
+				if (order[i] < first || order[i] >= first + classSize[cls] || seen[order[i] - first])
+				{
+					permutation = false;
+					break;
+				}
+				seen[order[i] - first] = true;
+			}
+			Check(permutation, "draw order is no permutation", population, cls);
+
+			first += classSize[cls];
+		}
+	}
+
+	if (numNegative == 0)
+	{
+		std::printf("no particle with negative semi-axes; the test does not cover them\n");
+		++failures;
+	}
+
+	std::printf("%d failures, %d particles with negative semi-axes\n", failures, numNegative);
+	return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}